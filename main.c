@@ -18,8 +18,30 @@
 #include "sys.h"
 #include "mod_gpio.h"
 #include "mod_msg.h"
+#include "mod_pool.h"
 #include "mod_stepgen.h"
 #include "mod_encoder.h"
+#if USE_PLANNER
+#include "mod_planner.h"
+#endif
+#if USE_CLOSEDLOOP
+#include "mod_closedloop.h"
+#endif
+#if USE_GEARING
+#include "mod_gearing.h"
+#endif
+#if USE_RASTER
+#include "mod_raster.h"
+#endif
+#if USE_SHAPER
+#include "mod_shaper.h"
+#endif
+#if USE_PULSGEN
+#include "mod_pulsgen.h"
+#endif
+#if USE_MICROSTEP
+#include "mod_microstep.h"
+#endif
 
 
 
@@ -33,15 +55,58 @@ int main(void)
     // modules init
     msg_module_init();
     gpio_module_init();
+    pool_module_init();
     stepgen_module_init();
     encoder_module_init();
+#if USE_PLANNER
+    planner_module_init();
+#endif
+#if USE_CLOSEDLOOP
+    closedloop_module_init();
+#endif
+#if USE_GEARING
+    gearing_module_init();
+#endif
+#if USE_RASTER
+    raster_module_init();
+#endif
+#if USE_SHAPER
+    shaper_module_init();
+#endif
+#if USE_PULSGEN
+    pulsgen_module_init();
+#endif
+#if USE_MICROSTEP
+    microstep_module_init();
+#endif
 
     // main loop
     for(;;)
     {
         msg_module_base_thread();
         encoder_module_base_thread();
+#if USE_CLOSEDLOOP
+        closedloop_module_base_thread();
+#endif
+#if USE_GEARING
+        gearing_module_base_thread();
+#endif
+#if USE_PLANNER
+        planner_module_base_thread();
+#endif
+#if USE_SHAPER
+        shaper_module_base_thread();
+#endif
         stepgen_module_base_thread();
+#if USE_RASTER
+        raster_module_base_thread();
+#endif
+#if USE_MICROSTEP
+        microstep_module_base_thread();
+#endif
+#if USE_PULSGEN
+        pulsgen_module_base_thread();
+#endif
     }
 
     return 0;
@@ -0,0 +1,397 @@
+/**
+ * @file    mod_closedloop.c
+ * @brief   closed-loop stepper module
+ * This module implements an API to check the stepgen channel position
+ * with the encoder counts and to correct the following error
+ *
+ * The following error is the commanded position (steps made by the channel
+ * minus the correction steps) minus the encoder position (scaled to steps).
+ * It's checked every pass of the main loop. A positive error means lost steps.
+ * A correction is counted when its steps are made, the next one waits for it.
+ * The encoder position is counted over the counts resets at the index (phase Z).
+ */
+
+#include "mod_stepgen.h"
+#include "mod_encoder.h"
+#include "mod_closedloop.h"
+
+
+
+
+#define BD bind[b] // current binding
+
+
+
+
+// private vars
+
+static closedloop_ch_t bind[CLOSEDLOOP_CH_CNT] = {0}; // array of bindings data
+static uint8_t msg_buf[CLOSEDLOOP_MSG_BUF_LEN] = {0}; // message buffer
+
+
+
+
+// private functions
+
+static uint32_t ns_to_ticks(uint32_t ns)
+{
+    return (uint32_t) ( (uint64_t)ns * (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+}
+
+// counts * num / den, without signed 64-bit division
+static int32_t ratio_apply(int32_t counts, int32_t num, uint32_t den)
+{
+    uint64_t m;
+
+    m = (uint64_t)(counts < 0 ? -(int64_t)counts : counts) *
+        (uint64_t)(num < 0 ? -(int64_t)num : num);
+    if ( den > 1 ) m = (m + den / 2) / den;
+
+    return (counts < 0) != (num < 0) ? -(int32_t)m : (int32_t)m;
+}
+
+// encoder position without the counts reset at the index (phase Z)
+static void encoder_read(uint8_t b)
+{
+    static int32_t counts;
+    static uint32_t index_cnt;
+
+    counts = encoder_counts_get(BD.encoder);
+    index_cnt = encoder_index_cnt_get(BD.encoder);
+
+    if ( index_cnt != BD.index_cnt ) // counts were reset to 0 at the index
+    {
+        BD.index_cnt = index_cnt;
+        BD.enc_pos += encoder_index_counts_get(BD.encoder) - BD.counts + counts;
+    }
+    else BD.enc_pos += counts - BD.counts;
+
+    BD.counts = counts;
+}
+
+static void alarm_send(uint8_t b)
+{
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    out->v[0] = b;
+    out->v[1] = BD.error;
+    out->v[2] = stepgen_pos_get(BD.stepgen);
+    out->v[3] = BD.enc_pos;
+
+    if ( !msg_send(CLOSEDLOOP_MSG_ALARM, msg_buf, 4*4) ) BD.alarm = CLOSEDLOOP_ALARM_SENT;
+}
+
+static void correct(uint8_t b, uint64_t tick)
+{
+    static int32_t n;
+
+    n = BD.error;
+    if ( n > (int32_t)BD.max_corr ) n = BD.max_corr;
+    if ( n < -(int32_t)BD.max_corr ) n = -(int32_t)BD.max_corr;
+
+    BD.pend_rest = stepgen_state_get(BD.stepgen) ? 0 : 1;
+    BD.pend_pos = stepgen_pos_get(BD.stepgen);
+
+    // moving? change the current STEP task
+    if ( !BD.pend_rest ) n = stepgen_steps_adjust(BD.stepgen, n);
+    // at rest, make the correction move
+    else if ( stepgen_task_add_ticks(BD.stepgen, STEPGEN_TASK_MOVE, (uint32_t)n,
+        BD.corr_ticks - BD.corr_ticks / 2, BD.corr_ticks / 2) < 0 ) n = 0;
+
+    if ( !n ) return;
+
+    BD.pend = n;
+    BD.corr_tick = tick;
+}
+
+// count the pending correction when its steps are made
+static void pend_update(uint8_t b, uint64_t tick)
+{
+    static int32_t a, d;
+
+    if ( BD.pend_rest ) // the correction move
+    {
+        d = stepgen_pos_get(BD.stepgen) - BD.pend_pos;
+
+        if ( BD.pend > 0 ? d >= BD.pend : d <= BD.pend ) BD.corr += BD.pend;
+        else if ( !stepgen_state_get(BD.stepgen) ) BD.corr += d; // aborted
+        else return;
+    }
+    else // the steps added to the running task
+    {
+        a = stepgen_steps_adjusted_get(BD.stepgen);
+
+        if ( a != BD.adjusted ) BD.corr += a - BD.adjusted;
+        else if ( stepgen_state_get(BD.stepgen) ) return;
+
+        BD.adjusted = a;
+    }
+
+    BD.pend = 0;
+    BD.corr_tick = tick; // let the encoder see the made steps
+}
+
+
+
+
+// public methods
+
+/**
+ * @brief   module init
+ * @note    call this function only once before closedloop_module_base_thread()
+ * @retval  none
+ */
+void closedloop_module_init()
+{
+    uint8_t i = 0;
+
+    // add message handlers
+    for ( i = CLOSEDLOOP_MSG_SETUP; i < CLOSEDLOOP_MSG_CNT; i++ )
+    {
+        msg_recv_callback_add(i, (msg_recv_func_t) closedloop_msg_recv);
+    }
+}
+
+/**
+ * @brief   module base thread
+ * @note    call this function in the main loop, after encoder_module_base_thread()
+ *          and before stepgen_module_base_thread()
+ * @retval  none
+ */
+void closedloop_module_base_thread()
+{
+    static uint8_t b;
+    static uint32_t e;
+    static uint64_t tick;
+
+    tick = timer_cnt_get_64();
+
+    for ( b = CLOSEDLOOP_CH_CNT; b--; )
+    {
+        if ( !BD.enabled ) continue;
+
+        encoder_read(b);
+        if ( BD.pend ) pend_update(b, tick);
+
+        BD.error = stepgen_pos_get(BD.stepgen) - BD.pos0 - BD.corr -
+            ratio_apply(BD.enc_pos, BD.num, BD.den);
+
+        e = BD.error < 0 ? -BD.error : BD.error;
+
+        // error is too big?
+        if ( BD.alarm_error && e > BD.alarm_error && !BD.alarm )
+        {
+            BD.alarm = CLOSEDLOOP_ALARM_PENDING;
+            if ( BD.alarm_abort ) stepgen_abort(BD.stepgen, 1);
+        }
+
+        if ( BD.alarm )
+        {
+            if ( BD.alarm == CLOSEDLOOP_ALARM_PENDING ) alarm_send(b);
+            continue; // no corrections until the next setup
+        }
+
+        // correction is needed and allowed?
+        if ( e > BD.deadband && BD.max_corr && !BD.pend && (tick - BD.corr_tick) >= BD.interval_ticks )
+        {
+            correct(b, tick);
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief   bind the stepgen channel to the encoder channel
+ *
+ * @param   b           binding id
+ * @param   enable      0 = disable, other values - enable
+ * @param   stepgen     stepgen channel id
+ * @param   encoder     encoder channel id
+ * @param   num         steps per `den` encoder counts, the sign is a direction
+ * @param   den         encoder counts per `num` steps
+ *
+ * @note    the current positions of both channels are matched,
+ *          the correction steps and the alarm state are reset
+ *
+ * @retval  none
+ */
+void closedloop_setup(uint8_t b, uint8_t enable, uint8_t stepgen, uint8_t encoder, int32_t num, uint32_t den)
+{
+    BD.enabled = 0;
+    BD.stepgen = stepgen;
+    BD.encoder = encoder;
+    BD.num = num;
+    BD.den = den ? den : 1;
+    BD.pos0 = stepgen_pos_get(stepgen);
+    BD.counts = encoder_counts_get(encoder);
+    BD.index_cnt = encoder_index_cnt_get(encoder);
+    BD.enc_pos = 0;
+    BD.corr = 0;
+    BD.pend = 0;
+    BD.adjusted = stepgen_steps_adjusted_get(stepgen);
+    BD.error = 0;
+    BD.alarm = CLOSEDLOOP_ALARM_NONE;
+    BD.corr_tick = 0;
+    BD.enabled = enable ? 1 : 0;
+}
+
+/**
+ * @brief   setup the following error limits of the binding
+ *
+ * @param   b           binding id
+ * @param   deadband    errors up to this value (in steps) are not corrected
+ * @param   max_corr    max steps of one correction, 0 = no corrections
+ * @param   alarm_error alarm on errors above this value (in steps), 0 = no alarm
+ * @param   alarm_abort abort all tasks of the stepgen channel on alarm?
+ * @param   corr_period step period of the correction made at rest (in nanoseconds)
+ * @param   interval    min time from the made correction to the next one (in nanoseconds)
+ *
+ * @note    the deadband must cover the motor lag at the max velocity,
+ *          the interval must cover the motor settle time
+ *
+ * @retval  none
+ */
+void closedloop_limits_setup(uint8_t b, uint32_t deadband, uint32_t max_corr, uint32_t alarm_error,
+    uint8_t alarm_abort, uint32_t corr_period, uint32_t interval)
+{
+    BD.deadband = deadband;
+    BD.max_corr = max_corr > INT32_MAX ? INT32_MAX : max_corr;
+    BD.alarm_error = alarm_error;
+    BD.alarm_abort = alarm_abort ? 1 : 0;
+    BD.corr_ticks = ns_to_ticks(corr_period);
+    if ( BD.corr_ticks < 2 ) BD.corr_ticks = 2;
+    BD.interval_ticks = ns_to_ticks(interval);
+}
+
+
+
+
+/**
+ * @brief   get the last following error of the binding
+ * @param   b   binding id
+ * @retval  error in steps, positive = lost steps
+ */
+int32_t closedloop_error_get(uint8_t b)
+{
+    return BD.error;
+}
+
+/**
+ * @brief   get the sum of the correction steps of the binding
+ * @param   b   binding id
+ * @note    queued correction steps are counted when they are made
+ * @retval  steps
+ */
+int32_t closedloop_corr_get(uint8_t b)
+{
+    return BD.corr;
+}
+
+/**
+ * @brief   get the alarm state of the binding
+ * @param   b   binding id
+ * @retval  0 (no alarm)
+ * @retval  1 (alarm, the message is not sent yet)
+ * @retval  2 (alarm)
+ */
+uint8_t closedloop_alarm_get(uint8_t b)
+{
+    return BD.alarm;
+}
+
+
+
+
+/**
+ * @brief   "message received" callback
+ *
+ * @note    this function will be called automatically
+ *          when a new message will arrive for this module.
+ *
+ * @param   type    user defined message type (0..0xFF)
+ * @param   msg     pointer to the message buffer
+ * @param   length  the length of a message (0 .. MSG_LEN)
+ *
+ * @retval   0 (message read)
+ * @retval  -1 (message not read)
+ */
+int8_t volatile closedloop_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
+{
+    u32_10_t *in = (u32_10_t*) msg;
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    switch (type)
+    {
+        case CLOSEDLOOP_MSG_SETUP:
+            closedloop_setup(in->v[0], in->v[1], in->v[2], in->v[3], (int32_t)in->v[4], in->v[5]);
+            break;
+        case CLOSEDLOOP_MSG_LIMITS_SETUP:
+            closedloop_limits_setup(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4], in->v[5], in->v[6]);
+            break;
+        case CLOSEDLOOP_MSG_STATE_GET:
+            out->v[0] = closedloop_error_get(in->v[0]);
+            out->v[1] = closedloop_corr_get(in->v[0]);
+            out->v[2] = closedloop_alarm_get(in->v[0]);
+            msg_send(type, msg_buf, 3*4);
+            break;
+
+        default: return -1;
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+    @example mod_closedloop.c
+
+    <b>Usage example 1</b>: 200 steps/rev motor with 16x microstepping
+    and 1000 lines (4000 counts/rev) encoder
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_stepgen.h"
+        #include "mod_encoder.h"
+        #include "mod_closedloop.h"
+
+        int main(void)
+        {
+            // modules init
+            stepgen_module_init();
+            encoder_module_init();
+            closedloop_module_init();
+
+            // STEP/DIR pins
+            stepgen_pin_setup(0, 0, PA, 3, 0);
+            stepgen_pin_setup(0, 1, PA, 5, 0);
+
+            // encoder pins
+            encoder_pin_setup(1, PHASE_A, PA, 6);
+            encoder_pin_setup(1, PHASE_B, PA, 7);
+            encoder_setup(1, 1, 0);
+
+            // 3200 steps = 4000 counts
+            closedloop_setup(0, 1, 0, 1, 3200, 4000);
+
+            // 4 steps deadband, up to 16 steps per correction,
+            // alarm and abort at 200 steps error,
+            // 50 us correction step period, 2 ms between corrections
+            closedloop_limits_setup(0, 4, 16, 200, 1, 50000, 2000000);
+
+            // main loop
+            for(;;)
+            {
+                encoder_module_base_thread();
+                closedloop_module_base_thread();
+                stepgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
+*/
@@ -0,0 +1,89 @@
+/**
+ * @file    mod_closedloop.h
+ * @brief   closed-loop stepper module header
+ * This module implements an API to check the stepgen channel position
+ * with the encoder counts and to correct the following error
+ */
+
+#ifndef _MOD_CLOSEDLOOP_H
+#define _MOD_CLOSEDLOOP_H
+
+#include <stdint.h>
+#include "mod_msg.h"
+#include "mod_timer.h"
+
+
+
+
+#define CLOSEDLOOP_CH_CNT       8   ///< maximum number of closed-loop bindings
+#define CLOSEDLOOP_MSG_BUF_LEN  MSG_LEN
+
+enum
+{
+    CLOSEDLOOP_MSG_SETUP = 0x70,
+    CLOSEDLOOP_MSG_LIMITS_SETUP,
+    CLOSEDLOOP_MSG_STATE_GET,
+    CLOSEDLOOP_MSG_ALARM, // ARISC -> ARM only
+    CLOSEDLOOP_MSG_CNT
+};
+
+/// alarm states
+enum
+{
+    CLOSEDLOOP_ALARM_NONE,
+    CLOSEDLOOP_ALARM_PENDING, // message is not sent yet
+    CLOSEDLOOP_ALARM_SENT
+};
+
+
+
+
+typedef struct
+{
+    uint8_t     enabled;
+    uint8_t     stepgen; // stepgen channel id
+    uint8_t     encoder; // encoder channel id
+
+    int32_t     num; // steps per `den` encoder counts, the sign is a direction
+    uint32_t    den;
+
+    int32_t     pos0; // stepgen position at the binding start
+    int32_t     counts; // last encoder counts, reset at every index
+    uint32_t    index_cnt; // last encoder index counter
+    int32_t     enc_pos; // encoder position since the binding start, over the index resets
+    int32_t     corr; // sum of the made correction steps
+    int32_t     pend; // correction steps queued but not made yet
+    uint8_t     pend_rest; // pending correction is a move made at rest
+    int32_t     pend_pos; // stepgen position before the move made at rest
+    int32_t     adjusted; // last stepgen_steps_adjusted_get() value
+    int32_t     error; // last following error (in steps)
+
+    uint32_t    deadband; // steps
+    uint32_t    max_corr; // max steps of one correction
+    uint32_t    alarm_error; // steps, 0 = no alarm
+    uint8_t     alarm_abort; // abort the stepgen channel on alarm?
+    uint8_t     alarm;
+
+    uint32_t    corr_ticks; // step period of the correction made at rest
+    uint32_t    interval_ticks; // min time between corrections
+    uint64_t    corr_tick; // time of the last correction
+
+} closedloop_ch_t;
+
+
+
+
+void closedloop_module_init();
+void closedloop_module_base_thread();
+void closedloop_setup(uint8_t b, uint8_t enable, uint8_t stepgen, uint8_t encoder, int32_t num, uint32_t den);
+void closedloop_limits_setup(uint8_t b, uint32_t deadband, uint32_t max_corr, uint32_t alarm_error,
+    uint8_t alarm_abort, uint32_t corr_period, uint32_t interval);
+int32_t closedloop_error_get(uint8_t b);
+int32_t closedloop_corr_get(uint8_t b);
+uint8_t closedloop_alarm_get(uint8_t b);
+int8_t volatile closedloop_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
+
+
+
+
+#endif
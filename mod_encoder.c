@@ -5,6 +5,9 @@
  *
  * This module implements an API
  * to make real-time counting of quadrature encoder pulses
+ *
+ * Every GPIO port used by the enabled channels is read once per pass,
+ * and all channels are decoded from this consistent sample.
  */
 
 #include "mod_gpio.h"
@@ -41,12 +44,34 @@ static uint8_t state_list[4] =
     /* 0b11 */ 0b10
 };
 
+static uint8_t ports_used = 0; // mask of the ports to read
+static uint32_t port_state[GPIO_PORTS_CNT] = {0}; // the ports sample
+
 // uses with GPIO module macros
 extern volatile uint32_t * gpio_port_data[GPIO_PORTS_CNT];
 
 
 
 
+// private functions
+
+static void ports_update()
+{
+    static uint8_t c;
+
+    for ( ports_used = 0, c = ENCODER_CH_CNT; c--; )
+    {
+        if ( !enc[c].enabled ) continue;
+
+        ports_used |= 1U << enc[c].port[PH_A];
+        if ( enc[c].using_B ) ports_used |= 1U << enc[c].port[PH_B];
+        if ( enc[c].using_Z ) ports_used |= 1U << enc[c].port[PH_Z];
+    }
+}
+
+
+
+
 // public methods
 
 /**
@@ -72,34 +97,50 @@ void encoder_module_init()
  */
 void encoder_module_base_thread()
 {
-    static uint8_t c = (ENCODER_CH_CNT - 1);
+    static uint8_t c, p;
     static uint32_t A, B, Z, AB;
 
-    if ( enc[c].enabled )
+    if ( !ports_used ) return;
+
+    // read all used ports at once
+    for ( p = GPIO_PORTS_CNT; p--; )
+    {
+        if ( ports_used & (1U << p) ) port_state[p] = *gpio_port_data[p];
+    }
+
+    for ( c = ENCODER_CH_CNT; c--; )
     {
+        if ( !enc[c].enabled ) continue;
+
         if ( enc[c].using_Z ) // if we are using ABZ encoder
         {
-            Z = GPIO_PIN_GET(enc[c].port[PH_Z], enc[c].pin_mask[PH_Z]);
+            Z = port_state[enc[c].port[PH_Z]] & enc[c].pin_mask[PH_Z];
 
             if ( enc[c].state[PH_Z] != Z ) // on phase Z state change
             {
-                if ( Z ) enc[c].counts = 0;
+                if ( Z )
+                {
+                    enc[c].index_counts = enc[c].counts;
+                    enc[c].index_cnt++;
+                    enc[c].counts = 0;
+                }
                 enc[c].state[PH_Z] = Z;
             }
         }
 
-        A = GPIO_PIN_GET(enc[c].port[PH_A], enc[c].pin_mask[PH_A]);
+        A = port_state[enc[c].port[PH_A]] & enc[c].pin_mask[PH_A];
 
         if ( enc[c].using_B ) // if we are using AB encoder
         {
-            B = GPIO_PIN_GET(enc[c].port[PH_B], enc[c].pin_mask[PH_B]);
+            B = port_state[enc[c].port[PH_B]] & enc[c].pin_mask[PH_B];
 
             if ( enc[c].state[PH_A] != A || enc[c].state[PH_B] != B ) // on any phase change
             {
-                AB = (A ? 0b10 : 0) | (A ? 0b01 : 0); // get encoder state
+                AB = (A ? 0b10 : 0) | (B ? 0b01 : 0); // get encoder state
 
                 if ( state_list[enc[c].AB_state] == AB ) enc[c].counts++; // CW
-                else                                     enc[c].counts--; // CCW
+                else if ( state_list[AB] == enc[c].AB_state ) enc[c].counts--; // CCW
+                // both phases changed, the direction is unknown
 
                 enc[c].AB_state = AB;
             }
@@ -113,9 +154,6 @@ void encoder_module_base_thread()
 
         enc[c].state[PH_A] = A;
     }
-
-    --c;
-    if ( !c ) c = (ENCODER_CH_CNT - 1);
 }
 
 
@@ -140,6 +178,8 @@ void encoder_pin_setup(uint8_t c, uint8_t phase, uint8_t port, uint8_t pin)
     enc[c].port[phase] = port;
     enc[c].pin_mask[phase] = 1U << pin;
     enc[c].state[phase] = GPIO_PIN_GET(port, enc[c].pin_mask[phase]);
+
+    if ( enc[c].enabled ) ports_update();
 }
 
 
@@ -163,6 +203,8 @@ void encoder_setup(uint8_t c, uint8_t using_B, uint8_t using_Z)
     // set encoder state
     enc[c].AB_state = (enc[c].state[PH_A] ? 0b10 : 0) |
                       (enc[c].state[PH_B] ? 0b01 : 0);
+
+    if ( enc[c].enabled ) ports_update();
 }
 
 /**
@@ -173,7 +215,23 @@ void encoder_setup(uint8_t c, uint8_t using_B, uint8_t using_Z)
  */
 void encoder_state_set(uint8_t c, uint8_t state)
 {
+    static uint8_t i;
+
+    // take the current phase states to not count them
+    if ( state && !enc[c].enabled )
+    {
+        for ( i = ENCODER_PH_CNT; i--; )
+        {
+            enc[c].state[i] = GPIO_PIN_GET(enc[c].port[i], enc[c].pin_mask[i]);
+        }
+
+        enc[c].AB_state = (enc[c].state[PH_A] ? 0b10 : 0) |
+                          (enc[c].state[PH_B] ? 0b01 : 0);
+    }
+
     enc[c].enabled = state ? 1 : 0;
+
+    ports_update();
 }
 
 /**
@@ -213,6 +271,27 @@ int32_t encoder_counts_get(uint8_t c)
     return enc[c].counts;
 }
 
+/**
+ * @brief   get number of the phase Z indexes for the selected channel
+ * @param   c   channel id
+ * @note    counts are reset to 0 at every index
+ * @retval  unsigned 32-bit number
+ */
+uint32_t encoder_index_cnt_get(uint8_t c)
+{
+    return enc[c].index_cnt;
+}
+
+/**
+ * @brief   get counts before the last phase Z index for the selected channel
+ * @param   c   channel id
+ * @retval  signed 32-bit number
+ */
+int32_t encoder_index_counts_get(uint8_t c)
+{
+    return enc[c].index_counts;
+}
+
 
 
 
@@ -16,7 +16,7 @@
 
 
 
-#define ENCODER_CH_CNT 8  ///< maximum number of encoder counter channels
+#define ENCODER_CH_CNT 16 ///< maximum number of encoder counter channels
 #define ENCODER_PH_CNT 3  ///< number of encoder phases
 
 
@@ -35,6 +35,9 @@ struct encoder_ch_t
 
     int32_t     counts;
     uint8_t     AB_state;
+
+    uint32_t    index_cnt; // number of the phase Z indexes
+    int32_t     index_counts; // counts before the last index
 };
 
 
@@ -82,6 +85,8 @@ void encoder_counts_set(uint8_t c, int32_t counts);
 
 uint8_t encoder_state_get(uint8_t c);
 int32_t encoder_counts_get(uint8_t c);
+uint32_t encoder_index_cnt_get(uint8_t c);
+int32_t encoder_index_counts_get(uint8_t c);
 int8_t volatile encoder_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
 
 
@@ -0,0 +1,449 @@
+/**
+ * @file    mod_gearing.c
+ * @brief   electronic gearing module
+ * This module implements an API to lock the stepgen channel position
+ * to the encoder position by a rational ratio
+ *
+ * The lock-in, index sync and offset moves are made by the stepgen channel
+ * in the position follower mode (stepgen_follow_setup()), its target is updated
+ * every period, so the velocity and acceleration limits of the follower
+ * are the gearing limits of these moves.
+ *
+ * When the follower has caught up the target (small lag for a few periods),
+ * it's switched off, the lag and every target change made by the encoder
+ * go to the stepgen as slices right in the same main loop pass
+ * (at the max velocity step rate), so the steps follow the encoder edges
+ * without the follower period delay.
+ * Target jumps over GEARING_DIRECT_MAX steps (offset changes, too fast encoder)
+ * and step rate changes over the acceleration limit (encoder jerks)
+ * hand the channel back to the follower at the current velocity.
+ */
+
+#include "mod_stepgen.h"
+#include "mod_encoder.h"
+#include "mod_gearing.h"
+
+
+
+
+#define BG gear[g] // current binding
+
+
+
+
+// private vars
+
+static gearing_ch_t gear[GEARING_CH_CNT] = {0}; // array of bindings data
+static uint8_t msg_buf[GEARING_MSG_BUF_LEN] = {0}; // message buffer
+
+
+
+
+// private functions
+
+static uint32_t ns_to_ticks(uint32_t ns)
+{
+    return (uint32_t) ( (uint64_t)ns * (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+}
+
+// counts * num / den, without signed 64-bit division
+static int32_t ratio_apply(int32_t counts, int32_t num, uint32_t den)
+{
+    uint64_t m;
+
+    m = (uint64_t)(counts < 0 ? -(int64_t)counts : counts) *
+        (uint64_t)(num < 0 ? -(int64_t)num : num);
+    if ( den > 1 ) m = (m + den / 2) / den;
+
+    return (counts < 0) != (num < 0) ? -(int32_t)m : (int32_t)m;
+}
+
+// steps/s of `steps` made in `ticks`, the sign is a direction
+static int32_t vel_get(int32_t steps, uint64_t ticks)
+{
+    uint64_t v = (uint64_t)(steps < 0 ? -steps : steps) * TIMER_FREQUENCY;
+
+    v = ticks ? v / ticks : v;
+    if ( v > INT32_MAX ) v = INT32_MAX;
+
+    return steps < 0 ? -(int32_t)v : (int32_t)v;
+}
+
+static uint64_t isqrt64(uint64_t x)
+{
+    uint64_t r = 0, b = 1ULL << 62;
+
+    while ( b > x ) b >>= 2;
+    for ( ; b; b >>= 2 )
+    {
+        if ( x >= r + b ) { x -= r + b; r = (r >> 1) + b; }
+        else r >>= 1;
+    }
+
+    return r;
+}
+
+// steps made with the velocity `v` (steps/s) in `ticks`
+static int64_t steps_get(int32_t v, uint64_t ticks)
+{
+    uint64_t x = (uint64_t)(v < 0 ? -(int64_t)v : v) * ticks / TIMER_FREQUENCY;
+    return v < 0 ? -(int64_t)x : (int64_t)x;
+}
+
+// `steps` made in `ticks` with the velocity `v` (steps/s) are over the acceleration limit?
+static uint8_t jerk(uint8_t g, int32_t v, int64_t steps, uint64_t ticks)
+{
+    uint64_t x;
+    int64_t e = steps - steps_get(v, ticks);
+
+    // a*t^2/2 steps, +/-1 step of the velocity estimates is allowed
+    x = (uint64_t)BG.max_accel * ticks / TIMER_FREQUENCY * ticks / TIMER_FREQUENCY / 2 + 2;
+
+    return (uint64_t)(e < 0 ? -e : e) > x ? 1 : 0;
+}
+
+// encoder position which doesn't jump at the index
+static void encoder_read(uint8_t g)
+{
+    static int32_t counts;
+    static uint32_t index_cnt;
+
+    counts = encoder_counts_get(BG.encoder);
+    index_cnt = encoder_index_cnt_get(BG.encoder);
+
+    if ( index_cnt != BG.index_cnt ) // counts were reset to 0 at the index
+    {
+        BG.index_cnt = index_cnt;
+
+        if ( BG.state == GEARING_WAIT_INDEX )
+        {
+            BG.state = GEARING_LOCKED;
+            BG.pos0 = stepgen_pos_get(BG.stepgen) - stepgen_steps_adjusted_get(BG.stepgen);
+            BG.enc_pos = counts;
+        }
+        else BG.enc_pos += encoder_index_counts_get(BG.encoder) - BG.counts + counts;
+    }
+    else BG.enc_pos += counts - BG.counts;
+
+    BG.counts = counts;
+}
+
+
+
+
+// public methods
+
+/**
+ * @brief   module init
+ * @note    call this function only once before gearing_module_base_thread()
+ * @retval  none
+ */
+void gearing_module_init()
+{
+    uint8_t i = 0;
+
+    for ( i = GEARING_CH_CNT; i--; ) gear[i].period = GEARING_PERIOD;
+
+    // add message handlers
+    for ( i = GEARING_MSG_SETUP; i < GEARING_MSG_CNT; i++ )
+    {
+        msg_recv_callback_add(i, (msg_recv_func_t) gearing_msg_recv);
+    }
+}
+
+/**
+ * @brief   module base thread
+ * @note    call this function in the main loop, after encoder_module_base_thread()
+ *          and before stepgen_module_base_thread()
+ * @retval  none
+ */
+void gearing_module_base_thread()
+{
+    static uint8_t g;
+    static uint64_t tick;
+    static int32_t target, n, v;
+    static uint8_t j;
+
+    tick = timer_cnt_get_64();
+
+    for ( g = GEARING_CH_CNT; g--; )
+    {
+        if ( !BG.state ) continue;
+
+        encoder_read(g);
+
+        if ( BG.state != GEARING_LOCKED ) continue;
+
+        target = BG.pos0 + BG.offset + ratio_apply(BG.enc_pos, BG.num, BG.den);
+
+        // the target moves faster or slower than the acceleration limit allows?
+        v = BG.vel;
+        j = jerk(g, v, target - BG.vel_pos, tick - BG.vel_tick);
+
+        // target velocity of the last check window
+        if ( tick - BG.vel_tick >= BG.vel_ticks )
+        {
+            BG.vel = vel_get(target - BG.vel_pos, tick - BG.vel_tick);
+            BG.vel_pos = target;
+            BG.vel_tick = tick;
+        }
+
+        if ( BG.feed == GEARING_FEED_DIRECT )
+        {
+            BG.target = target;
+            n = target - BG.sent;
+
+            // too far or the rate change is over the acceleration limit?
+            // hand the channel over to the follower at the current velocity
+            if ( n > GEARING_DIRECT_MAX || n < -GEARING_DIRECT_MAX || j )
+            {
+                stepgen_follow_setup(BG.stepgen, 1, BG.period, BG.max_vel, BG.max_accel);
+                stepgen_follow_start(BG.stepgen, BG.sent, v);
+                BG.feed = GEARING_FEED_FOLLOW;
+                BG.caught = 0;
+                BG.todo_tick = tick;
+            }
+            else
+            {
+                if ( n && !stepgen_slice_add(BG.stepgen, n, (uint32_t)(n < 0 ? -n : n) * BG.step_ticks) )
+                    BG.sent = target;
+                continue;
+            }
+        }
+
+        if ( tick < BG.todo_tick ) continue;
+
+        BG.target = target;
+        stepgen_target_set(BG.stepgen, BG.target, BG.vel);
+
+        BG.todo_tick += BG.period_ticks;
+        if ( BG.todo_tick <= tick ) BG.todo_tick = tick + BG.period_ticks;
+
+        // follower has caught up the target and its velocity? switch to the direct feed
+        n = BG.target - stepgen_follow_pos_get(BG.stepgen);
+        BG.caught = (n <= GEARING_CATCH_LAG && n >= -GEARING_CATCH_LAG &&
+            !jerk(g, stepgen_follow_vel_get(BG.stepgen),
+                steps_get(BG.vel, BG.vel_ticks), BG.vel_ticks)) ? BG.caught + 1 : 0;
+
+        if ( BG.caught < GEARING_CATCH_CNT ) continue;
+
+        stepgen_follow_setup(BG.stepgen, 0, BG.period, BG.max_vel, BG.max_accel);
+        BG.sent = stepgen_follow_pos_get(BG.stepgen);
+        BG.feed = GEARING_FEED_DIRECT;
+    }
+}
+
+
+
+
+/**
+ * @brief   lock the stepgen channel to the encoder channel
+ *
+ * @param   g           binding id
+ * @param   enable      0 = disable, other values - enable
+ * @param   stepgen     stepgen channel id
+ * @param   encoder     encoder channel id
+ * @param   num         steps per `den` encoder counts, the sign is a direction
+ * @param   den         encoder counts per `num` steps
+ * @param   index_sync  lock at the next encoder index (phase Z)?
+ *
+ * @note    without the index sync the current positions are locked at once,
+ *          with the index sync the stepgen position is locked to the index,
+ *          so the encoder counts made after the index are caught up.
+ *          Use gearing_limits_setup() before this call.
+ *
+ * @retval  none
+ */
+void gearing_setup(uint8_t g, uint8_t enable, uint8_t stepgen, uint8_t encoder,
+    int32_t num, uint32_t den, uint8_t index_sync)
+{
+    // release the previous stepgen channel
+    if ( BG.state ) stepgen_follow_setup(BG.stepgen, 0, BG.period, BG.max_vel, BG.max_accel);
+
+    BG.state = GEARING_OFF;
+    if ( !enable ) return;
+
+    BG.stepgen = stepgen;
+    BG.encoder = encoder;
+    BG.num = num;
+    BG.den = den ? den : 1;
+    BG.counts = encoder_counts_get(encoder);
+    BG.index_cnt = encoder_index_cnt_get(encoder);
+    BG.pos0 = stepgen_pos_get(stepgen) - stepgen_steps_adjusted_get(stepgen); // follower position
+    BG.enc_pos = 0;
+    BG.target = BG.pos0 + BG.offset;
+    BG.period_ticks = ns_to_ticks(BG.period);
+    BG.step_ticks = BG.max_vel ? TIMER_FREQUENCY / BG.max_vel : BG.period_ticks;
+    BG.todo_tick = timer_cnt_get_64();
+
+    // the +/-1 step error of the velocity check is about the acceleration limit
+    BG.vel_ticks = (uint32_t) isqrt64( 2 * (uint64_t)TIMER_FREQUENCY * TIMER_FREQUENCY / (BG.max_accel ? BG.max_accel : 1) );
+    if ( BG.vel_ticks < BG.period_ticks ) BG.vel_ticks = BG.period_ticks;
+    if ( BG.vel_ticks > TIMER_FREQUENCY / 10 ) BG.vel_ticks = TIMER_FREQUENCY / 10;
+    BG.vel_tick = BG.todo_tick;
+    BG.vel_pos = BG.target;
+    BG.vel = 0;
+    BG.feed = GEARING_FEED_FOLLOW;
+    BG.caught = 0;
+
+    stepgen_follow_setup(stepgen, 1, BG.period, BG.max_vel, BG.max_accel);
+
+    BG.state = index_sync ? GEARING_WAIT_INDEX : GEARING_LOCKED;
+}
+
+/**
+ * @brief   setup the binding limits
+ *
+ * @param   g           binding id
+ * @param   period      follower target update period (in nanoseconds)
+ * @param   max_vel     max velocity (in steps per second)
+ * @param   max_accel   max acceleration (in steps per second^2)
+ *
+ * @note    the new limits are used by the next gearing_setup() call.
+ *          The direct feed makes steps with the encoder acceleration
+ *          and with the `max_vel` step rate at most, a rate change
+ *          over `max_accel` hands the channel back to the follower.
+ *
+ * @retval  none
+ */
+void gearing_limits_setup(uint8_t g, uint32_t period, uint32_t max_vel, uint32_t max_accel)
+{
+    BG.period = period ? period : GEARING_PERIOD;
+    BG.max_vel = max_vel;
+    BG.max_accel = max_accel;
+}
+
+/**
+ * @brief   set the phase offset of the binding
+ * @param   g       binding id
+ * @param   offset  steps added to the geared position
+ * @note    the offset change is made with the follower limits
+ *          if it's larger than GEARING_DIRECT_MAX steps
+ * @retval  none
+ */
+void gearing_offset_set(uint8_t g, int32_t offset)
+{
+    BG.offset = offset;
+}
+
+
+
+
+/**
+ * @brief   get the binding state
+ * @param   g   binding id
+ * @retval  GEARING_OFF, GEARING_WAIT_INDEX or GEARING_LOCKED
+ */
+uint8_t gearing_state_get(uint8_t g)
+{
+    return BG.state;
+}
+
+/**
+ * @brief   get the last target position of the binding
+ * @param   g   binding id
+ * @retval  steps
+ */
+int32_t gearing_target_get(uint8_t g)
+{
+    return BG.target;
+}
+
+
+
+
+/**
+ * @brief   "message received" callback
+ *
+ * @note    this function will be called automatically
+ *          when a new message will arrive for this module.
+ *
+ * @param   type    user defined message type (0..0xFF)
+ * @param   msg     pointer to the message buffer
+ * @param   length  the length of a message (0 .. MSG_LEN)
+ *
+ * @retval   0 (message read)
+ * @retval  -1 (message not read)
+ */
+int8_t volatile gearing_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
+{
+    u32_10_t *in = (u32_10_t*) msg;
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    switch (type)
+    {
+        case GEARING_MSG_SETUP:
+            gearing_setup(in->v[0], in->v[1], in->v[2], in->v[3], (int32_t)in->v[4], in->v[5], in->v[6]);
+            break;
+        case GEARING_MSG_LIMITS_SETUP:
+            gearing_limits_setup(in->v[0], in->v[1], in->v[2], in->v[3]);
+            break;
+        case GEARING_MSG_OFFSET_SET:
+            gearing_offset_set(in->v[0], (int32_t)in->v[1]);
+            break;
+        case GEARING_MSG_STATE_GET:
+            out->v[0] = gearing_state_get(in->v[0]);
+            out->v[1] = gearing_target_get(in->v[0]);
+            out->v[2] = gearing_target_get(in->v[0]) - stepgen_pos_get(gear[in->v[0]].stepgen) +
+                stepgen_steps_adjusted_get(gear[in->v[0]].stepgen);
+            msg_send(type, msg_buf, 3*4);
+            break;
+
+        default: return -1;
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+    @example mod_gearing.c
+
+    <b>Usage example 1</b>: lathe threading, 1.5 mm pitch,
+    1000 lines (4000 counts/rev) spindle encoder, 400 steps/mm Z axis
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_stepgen.h"
+        #include "mod_encoder.h"
+        #include "mod_gearing.h"
+
+        int main(void)
+        {
+            // modules init
+            stepgen_module_init();
+            encoder_module_init();
+            gearing_module_init();
+
+            // Z axis STEP/DIR pins
+            stepgen_pin_setup(0, 0, PA, 3, 0);
+            stepgen_pin_setup(0, 1, PA, 5, 0);
+
+            // spindle encoder with the index
+            encoder_pin_setup(1, PHASE_A, PA, 6);
+            encoder_pin_setup(1, PHASE_B, PA, 7);
+            encoder_pin_setup(1, PHASE_Z, PA, 8);
+            encoder_setup(1, 1, 1);
+            encoder_state_set(1, 1);
+
+            // 100 us follower updates, 40 kHz max rate, 400000 steps/s^2 max acceleration
+            gearing_limits_setup(0, 100000, 40000, 400000);
+
+            // 600 steps per revolution, start at the next index
+            gearing_setup(0, 1, 0, 1, 600, 4000, 1);
+
+            // main loop
+            for(;;)
+            {
+                encoder_module_base_thread();
+                gearing_module_base_thread();
+                stepgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
+*/
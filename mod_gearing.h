@@ -0,0 +1,102 @@
+/**
+ * @file    mod_gearing.h
+ * @brief   electronic gearing module header
+ * This module implements an API to lock the stepgen channel position
+ * to the encoder position by a rational ratio
+ */
+
+#ifndef _MOD_GEARING_H
+#define _MOD_GEARING_H
+
+#include <stdint.h>
+#include "mod_msg.h"
+#include "mod_timer.h"
+
+
+
+
+#define GEARING_CH_CNT          4       ///< maximum number of gearing bindings
+#define GEARING_MSG_BUF_LEN     MSG_LEN
+
+#define GEARING_PERIOD          100000  ///< default target update period (in nanoseconds)
+#define GEARING_DIRECT_MAX      16      ///< max target change (in steps) sent to the stepgen as is
+#define GEARING_CATCH_LAG       2       ///< max follower lag (in steps) for the direct feed
+#define GEARING_CATCH_CNT       4       ///< follower updates with a small lag before the direct feed
+
+enum
+{
+    GEARING_MSG_SETUP = 0x78,
+    GEARING_MSG_LIMITS_SETUP,
+    GEARING_MSG_OFFSET_SET,
+    GEARING_MSG_STATE_GET,
+    GEARING_MSG_CNT
+};
+
+/// binding states
+enum
+{
+    GEARING_OFF,
+    GEARING_WAIT_INDEX, // waiting for the encoder index
+    GEARING_LOCKED
+};
+
+/// ways the target goes to the stepgen channel
+enum
+{
+    GEARING_FEED_FOLLOW, // position follower with the gearing limits
+    GEARING_FEED_DIRECT // target changes are stepgen slices at once
+};
+
+
+
+
+typedef struct
+{
+    uint8_t     state;
+    uint8_t     stepgen; // stepgen channel id
+    uint8_t     encoder; // encoder channel id
+
+    int32_t     num; // steps per `den` encoder counts, the sign is a direction
+    uint32_t    den;
+    int32_t     offset; // phase offset (in steps)
+
+    int32_t     pos0; // stepgen position at the lock
+    int32_t     enc_pos; // encoder position since the lock (counts)
+    int32_t     counts; // last encoder counts
+    uint32_t    index_cnt; // last encoder index number
+    int32_t     target; // last target position (in steps)
+
+    uint8_t     feed; // GEARING_FEED_x
+    uint8_t     caught; // follower updates in a row with a small lag
+    int32_t     sent; // position sent to the stepgen by the direct feed
+    uint32_t    step_ticks; // direct feed step period
+    int32_t     vel; // target velocity (steps/s) of the last check window
+    int32_t     vel_pos; // target at the last velocity check
+    uint32_t    vel_ticks; // velocity check window
+    uint64_t    vel_tick; // time of the last velocity check
+
+    uint32_t    period; // target update period (in nanoseconds)
+    uint32_t    max_vel; // steps/s
+    uint32_t    max_accel; // steps/s^2
+    uint32_t    period_ticks;
+    uint64_t    todo_tick; // time of the next target update
+
+} gearing_ch_t;
+
+
+
+
+void gearing_module_init();
+void gearing_module_base_thread();
+void gearing_setup(uint8_t g, uint8_t enable, uint8_t stepgen, uint8_t encoder,
+    int32_t num, uint32_t den, uint8_t index_sync);
+void gearing_limits_setup(uint8_t g, uint32_t period, uint32_t max_vel, uint32_t max_accel);
+void gearing_offset_set(uint8_t g, int32_t offset);
+uint8_t gearing_state_get(uint8_t g);
+int32_t gearing_target_get(uint8_t g);
+int8_t volatile gearing_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
+
+
+
+
+#endif
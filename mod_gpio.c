@@ -105,6 +105,18 @@ void gpio_pin_setup_for_input(uint32_t port, uint32_t pin)
     gpio_set_pincfg(port, pin, GPIO_FUNC_INPUT);
 }
 
+/**
+ * @brief   set pin mode to the peripheral function
+ * @param   port    GPIO port number    (0 .. GPIO_PORTS_CNT)
+ * @param   pin     GPIO pin number     (0 .. GPIO_PINS_CNT)
+ * @param   func    pin function        (GPIO_FUNC_BANK_...)
+ * @retval  none
+ */
+void gpio_pin_setup_for_func(uint32_t port, uint32_t pin, uint32_t func)
+{
+    gpio_set_pincfg(port, pin, func);
+}
+
 
 
 
@@ -47,6 +47,8 @@ enum { PA, PB, PC, PD, PE, PF, PG, PL };
 #define GPIO_FUNC_BANK_A_I2C1   3
 #define GPIO_FUNC_BANK_E_I2C2   3
 #define GPIO_FUNC_BANK_L_I2C3   2
+#define GPIO_FUNC_BANK_A_PWM0   3
+#define GPIO_FUNC_BANK_L_S_PWM  2
 
 /// the GPIO pin states
 enum { LOW, HIGH };
@@ -92,6 +94,10 @@ struct gpio_msg_state_t     { uint32_t state; };
 #define GPIO_PIN_GET(PORT,PIN_MASK) \
     (*gpio_port_data[PORT] & PIN_MASK)
 
+/// set and clear port pins by masks using a single write
+#define GPIO_PORT_UPDATE(PORT,SET_MASK,CLEAR_MASK) \
+    *gpio_port_data[PORT] = (*gpio_port_data[PORT] & ~(CLEAR_MASK)) | (SET_MASK)
+
 
 
 
@@ -101,6 +107,7 @@ void gpio_module_init();
 
 void gpio_pin_setup_for_output(uint32_t port, uint32_t pin);
 void gpio_pin_setup_for_input(uint32_t port, uint32_t pin);
+void gpio_pin_setup_for_func(uint32_t port, uint32_t pin, uint32_t func);
 
 uint32_t gpio_pin_get(uint32_t port, uint32_t pin);
 void gpio_pin_set(uint32_t port, uint32_t pin);
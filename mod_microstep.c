@@ -0,0 +1,375 @@
+/**
+ * @file    mod_microstep.c
+ * @brief   microstepping driver module
+ * This module implements an API to drive the stepper motor coils
+ * by the H-bridges using the stepgen channel position and sine/cosine PWM
+ *
+ * The stepgen channel makes no STEP/DIR output, its position is a microstep
+ * of the motor. The electrical angle of the position is taken
+ * from the quarter-wave sine table, phase A current is the sine
+ * and phase B current is the cosine. Every phase uses 2 pulsgen channels
+ * in the PWM mode, one for each current direction, so put all 4 channels
+ * of the motor to the same PWM group and GPIO port.
+ */
+
+#include "mod_stepgen.h"
+#include "mod_pulsgen.h"
+#include "mod_microstep.h"
+
+
+
+
+#define M mot[m] // current motor
+
+
+
+
+// private vars
+
+static microstep_ch_t mot[MICROSTEP_CH_CNT] = {{0}}; // array of motors data
+static uint8_t msg_buf[MICROSTEP_MSG_BUF_LEN] = {0}; // message buffer
+
+// sin(0..90 degrees) * 65535
+static const uint16_t sine_table[MICROSTEP_TABLE_SIZE + 1] =
+{
+        0,   402,   804,  1206,  1608,  2010,  2412,  2814,
+     3216,  3617,  4019,  4420,  4821,  5222,  5623,  6023,
+     6424,  6824,  7223,  7623,  8022,  8421,  8820,  9218,
+     9616, 10014, 10411, 10808, 11204, 11600, 11996, 12391,
+    12785, 13179, 13573, 13966, 14359, 14751, 15142, 15533,
+    15924, 16313, 16703, 17091, 17479, 17866, 18253, 18639,
+    19024, 19408, 19792, 20175, 20557, 20939, 21319, 21699,
+    22078, 22456, 22834, 23210, 23586, 23960, 24334, 24707,
+    25079, 25450, 25820, 26189, 26557, 26925, 27291, 27656,
+    28020, 28383, 28745, 29106, 29465, 29824, 30181, 30538,
+    30893, 31247, 31600, 31952, 32302, 32651, 32999, 33346,
+    33692, 34036, 34379, 34721, 35061, 35400, 35738, 36074,
+    36409, 36743, 37075, 37406, 37736, 38064, 38390, 38715,
+    39039, 39361, 39682, 40001, 40319, 40635, 40950, 41263,
+    41575, 41885, 42194, 42500, 42806, 43109, 43411, 43712,
+    44011, 44308, 44603, 44897, 45189, 45479, 45768, 46055,
+    46340, 46624, 46905, 47185, 47464, 47740, 48014, 48287,
+    48558, 48827, 49095, 49360, 49624, 49885, 50145, 50403,
+    50659, 50913, 51166, 51416, 51664, 51911, 52155, 52398,
+    52638, 52877, 53113, 53348, 53580, 53811, 54039, 54266,
+    54490, 54713, 54933, 55151, 55367, 55582, 55794, 56003,
+    56211, 56417, 56620, 56822, 57021, 57218, 57413, 57606,
+    57797, 57985, 58171, 58356, 58537, 58717, 58895, 59070,
+    59243, 59414, 59582, 59749, 59913, 60075, 60234, 60391,
+    60546, 60699, 60850, 60998, 61144, 61287, 61429, 61567,
+    61704, 61838, 61970, 62100, 62227, 62352, 62475, 62595,
+    62713, 62829, 62942, 63053, 63161, 63267, 63371, 63472,
+    63571, 63668, 63762, 63853, 63943, 64030, 64114, 64196,
+    64276, 64353, 64428, 64500, 64570, 64638, 64703, 64765,
+    64826, 64883, 64939, 64992, 65042, 65090, 65136, 65179,
+    65219, 65258, 65293, 65327, 65357, 65386, 65412, 65435,
+    65456, 65475, 65491, 65504, 65515, 65524, 65530, 65534,
+    65535
+};
+
+
+
+
+// private functions
+
+static uint32_t ns_to_ticks(uint32_t ns)
+{
+    return (uint32_t) ( (uint64_t)ns * (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+}
+
+// sine of the electrical angle, -65535..65535
+static int32_t sine(uint32_t angle)
+{
+    static uint32_t i;
+
+    i = angle % MICROSTEP_TABLE_SIZE;
+
+    switch ( (angle / MICROSTEP_TABLE_SIZE) & 3 )
+    {
+        case 0:  return  sine_table[i];
+        case 1:  return  sine_table[MICROSTEP_TABLE_SIZE - i];
+        case 2:  return -sine_table[i];
+        default: return -sine_table[MICROSTEP_TABLE_SIZE - i];
+    }
+}
+
+// electrical angle of the position, without signed division
+static uint32_t angle_get(uint8_t m, int32_t pos)
+{
+    static uint32_t cycle, i;
+
+    cycle = 4 * (uint32_t)M.usteps; // microsteps per electrical cycle
+
+    if ( pos >= 0 ) i = (uint32_t)pos % cycle;
+    else i = cycle - 1 - (uint32_t)(-(pos + 1)) % cycle;
+
+    return i * MICROSTEP_TABLE_SIZE / M.usteps;
+}
+
+// set PWM duty of one phase by the signed current
+static void phase_set(uint8_t pwm, int32_t value, uint32_t amp)
+{
+    static uint32_t duty;
+
+    duty = (uint32_t) ( ((uint64_t)amp * (uint32_t)(value < 0 ? -value : value)) >> 16 );
+
+    pulsgen_duty_set(pwm,     value > 0 ? duty : 0);
+    pulsgen_duty_set(pwm + 1, value < 0 ? duty : 0);
+}
+
+static void coils_update(uint8_t m)
+{
+    phase_set(M.pwm,     sine(M.angle), M.amp);
+    phase_set(M.pwm + 2, sine(M.angle + MICROSTEP_TABLE_SIZE), M.amp);
+}
+
+
+
+
+// public methods
+
+/**
+ * @brief   module init
+ * @note    call this function only once before microstep_module_base_thread()
+ * @retval  none
+ */
+void microstep_module_init()
+{
+    uint8_t i = 0;
+
+    for ( i = MICROSTEP_CH_CNT; i--; )
+    {
+        mot[i].run_amp = PULSGEN_DUTY_MAX;
+        mot[i].hold_amp = PULSGEN_DUTY_MAX / 2;
+        mot[i].hold_ticks = ns_to_ticks(MICROSTEP_HOLD_TIME);
+    }
+
+    // add message handlers
+    for ( i = MICROSTEP_MSG_SETUP; i < MICROSTEP_MSG_CNT; i++ )
+    {
+        msg_recv_callback_add(i, (msg_recv_func_t) microstep_msg_recv);
+    }
+}
+
+/**
+ * @brief   module base thread
+ * @note    call this function in the main loop, after stepgen_module_base_thread()
+ *          and before pulsgen_module_base_thread()
+ * @retval  none
+ */
+void microstep_module_base_thread()
+{
+    static uint8_t m;
+    static int32_t pos;
+    static uint32_t amp;
+    static uint64_t tick;
+
+    tick = timer_cnt_get_64();
+
+    for ( m = MICROSTEP_CH_CNT; m--; )
+    {
+        if ( !M.enabled ) continue;
+
+        pos = stepgen_pos_get(M.stepgen);
+
+        if ( pos != M.pos )
+        {
+            M.pos = pos;
+            M.move_tick = tick;
+            M.angle = angle_get(m, pos);
+            M.amp = M.run_amp;
+            coils_update(m);
+            continue;
+        }
+
+        // standstill? use the hold current
+        amp = (tick - M.move_tick) >= M.hold_ticks ? M.hold_amp : M.run_amp;
+        if ( amp == M.amp ) continue;
+
+        M.amp = amp;
+        coils_update(m);
+    }
+}
+
+
+
+
+/**
+ * @brief   setup the motor
+ *
+ * @param   m       motor id
+ * @param   enable  0 = disable, other values - enable
+ * @param   c       stepgen channel id
+ * @param   pwm     1st of 4 pulsgen channels: A+, A-, B+, B-
+ * @param   usteps  microsteps per full step (1..MICROSTEP_USTEPS_MAX),
+ *                  use the power of 2 for the equal microsteps
+ *
+ * @note    pulsgen channels must be set to the PWM mode before,
+ *          the disabled motor turns the coils off
+ *
+ * @retval  none
+ */
+void microstep_setup(uint8_t m, uint8_t enable, uint8_t c, uint8_t pwm, uint16_t usteps)
+{
+    if ( M.enabled )
+    {
+        M.enabled = 0;
+        M.amp = 0;
+        coils_update(m);
+    }
+
+    if ( !enable ) return;
+
+    if ( !usteps ) usteps = 1;
+    if ( usteps > MICROSTEP_USTEPS_MAX ) usteps = MICROSTEP_USTEPS_MAX;
+
+    M.stepgen = c;
+    M.pwm = pwm;
+    M.usteps = usteps;
+    M.pos = stepgen_pos_get(c);
+    M.angle = angle_get(m, M.pos);
+    M.move_tick = timer_cnt_get_64();
+    M.amp = M.run_amp;
+    coils_update(m);
+
+    M.enabled = 1;
+}
+
+/**
+ * @brief   set the coil currents of the motor
+ *
+ * @param   m           motor id
+ * @param   run         current while moving, 0..PULSGEN_DUTY_MAX
+ * @param   hold        current at standstill, 0..PULSGEN_DUTY_MAX
+ * @param   hold_time   standstill time before the hold current (in nanoseconds)
+ *
+ * @retval  none
+ */
+void microstep_current_set(uint8_t m, uint32_t run, uint32_t hold, uint32_t hold_time)
+{
+    M.run_amp = run > PULSGEN_DUTY_MAX ? PULSGEN_DUTY_MAX : run;
+    M.hold_amp = hold > PULSGEN_DUTY_MAX ? PULSGEN_DUTY_MAX : hold;
+    M.hold_ticks = ns_to_ticks(hold_time);
+
+    // use the new current at once
+    M.amp = 0;
+}
+
+
+
+
+/**
+ * @brief   get the electrical angle of the motor
+ * @param   m   motor id
+ * @retval  0..(4*MICROSTEP_TABLE_SIZE - 1)
+ */
+uint32_t microstep_angle_get(uint8_t m)
+{
+    return M.angle;
+}
+
+/**
+ * @brief   get the coil current in use
+ * @param   m   motor id
+ * @retval  0..PULSGEN_DUTY_MAX
+ */
+uint32_t microstep_amp_get(uint8_t m)
+{
+    return M.amp;
+}
+
+
+
+
+/**
+ * @brief   "message received" callback
+ *
+ * @note    this function will be called automatically
+ *          when a new message will arrive for this module.
+ *
+ * @param   type    user defined message type (0..0xFF)
+ * @param   msg     pointer to the message buffer
+ * @param   length  the length of a message (0 .. MSG_LEN)
+ *
+ * @retval   0 (message read)
+ * @retval  -1 (message not read)
+ */
+int8_t volatile microstep_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
+{
+    u32_10_t *in = (u32_10_t*) msg;
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    switch (type)
+    {
+        case MICROSTEP_MSG_SETUP:
+            microstep_setup(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4]);
+            break;
+        case MICROSTEP_MSG_CURRENT_SET:
+            microstep_current_set(in->v[0], in->v[1], in->v[2], in->v[3]);
+            break;
+        case MICROSTEP_MSG_STATE_GET:
+            out->v[0] = mot[in->v[0]].enabled;
+            out->v[1] = microstep_angle_get(in->v[0]);
+            out->v[2] = microstep_amp_get(in->v[0]);
+            msg_send(type, msg_buf, 3*4);
+            break;
+
+        default: return -1;
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+    @example mod_microstep.c
+
+    <b>Usage example 1</b>: small stepper on 2 H-bridges (PA0..PA3), 16 microsteps
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_stepgen.h"
+        #include "mod_pulsgen.h"
+        #include "mod_microstep.h"
+
+        int main(void)
+        {
+            uint8_t c;
+
+            // modules init
+            stepgen_module_init();
+            pulsgen_module_init();
+            microstep_module_init();
+
+            // A+, A-, B+, B- bridge inputs, 20 kHz PWM
+            for ( c = 0; c < 4; c++ )
+            {
+                pulsgen_pin_setup(c, PA, c, 0);
+                pulsgen_mode_set(c, PULSGEN_MODE_PWM, 0);
+            }
+            pulsgen_group_setup(0, 1, 50000, 0, 0);
+
+            // 70% current while moving, 30% at standstill after 200 ms
+            microstep_current_set(0, PULSGEN_DUTY_MAX / 10 * 7, PULSGEN_DUTY_MAX / 10 * 3, 200000000);
+
+            // stepgen channel 0 position is the motor microstep
+            microstep_setup(0, 1, 0, 0, 16);
+
+            // 3200 microsteps (1 turn of 200 steps/rev motor) at 4 kHz
+            stepgen_task_add(0, STEPGEN_TASK_MOVE, 3200, 125000, 125000);
+
+            // main loop
+            for(;;)
+            {
+                stepgen_module_base_thread();
+                microstep_module_base_thread();
+                pulsgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
+*/
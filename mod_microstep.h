@@ -0,0 +1,67 @@
+/**
+ * @file    mod_microstep.h
+ * @brief   microstepping driver module header
+ * This module implements an API to drive the stepper motor coils
+ * by the H-bridges using the stepgen channel position and sine/cosine PWM
+ */
+
+#ifndef _MOD_MICROSTEP_H
+#define _MOD_MICROSTEP_H
+
+#include <stdint.h>
+#include "mod_msg.h"
+#include "mod_timer.h"
+
+
+
+
+#define MICROSTEP_CH_CNT        4       ///< maximum number of motors
+#define MICROSTEP_USTEPS_MAX    256     ///< max microsteps per full step
+#define MICROSTEP_TABLE_SIZE    256     ///< sine table points per full step (90 degrees)
+#define MICROSTEP_HOLD_TIME     500000000 ///< default standstill time before the hold current (in nanoseconds)
+#define MICROSTEP_MSG_BUF_LEN   MSG_LEN
+
+enum
+{
+    MICROSTEP_MSG_SETUP = 0xA8,
+    MICROSTEP_MSG_CURRENT_SET,
+    MICROSTEP_MSG_STATE_GET,
+    MICROSTEP_MSG_CNT
+};
+
+
+
+
+typedef struct
+{
+    uint8_t     enabled;
+    uint8_t     stepgen; // stepgen channel id
+    uint8_t     pwm; // 1st of 4 pulsgen PWM channels: A+, A-, B+, B-
+    uint16_t    usteps; // microsteps per full step
+
+    uint32_t    run_amp; // coil current while moving, 0..PULSGEN_DUTY_MAX
+    uint32_t    hold_amp; // coil current at standstill
+    uint32_t    hold_ticks; // standstill time before the hold current
+    uint32_t    amp; // current in use
+
+    int32_t     pos; // last stepgen position
+    uint32_t    angle; // electrical angle, 4*MICROSTEP_TABLE_SIZE per cycle
+    uint64_t    move_tick; // last position change time
+
+} microstep_ch_t;
+
+
+
+
+void microstep_module_init();
+void microstep_module_base_thread();
+void microstep_setup(uint8_t m, uint8_t enable, uint8_t c, uint8_t pwm, uint16_t usteps);
+void microstep_current_set(uint8_t m, uint32_t run, uint32_t hold, uint32_t hold_time);
+uint32_t microstep_angle_get(uint8_t m);
+uint32_t microstep_amp_get(uint8_t m);
+int8_t volatile microstep_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
+
+
+
+
+#endif
@@ -0,0 +1,782 @@
+/**
+ * @file    mod_planner.c
+ * @brief   look-ahead motion planner module
+ * This module implements an API to make blended multi-axis moves
+ * using the stepgen channels as outputs
+ *
+ * All velocities are kept in steps per slice (Q16) and all squared
+ * velocities in (steps per slice)^2 (Q32), so no FPU is needed.
+ * Every slice the planner sends one slice of steps per axis
+ * to the stepgen module, so the axes never drift apart.
+ *
+ * The segments are planned in cartesian space, every slice end is
+ * converted to the motors positions by the selected kinematics,
+ * so the motors path is linearized with the slice rate.
+ * A delta slice is split into up to PLANNER_SUBSLICES sub-slices,
+ * so the carriages path stays within one step of the exact one.
+ */
+
+#include "mod_timer.h"
+#include "mod_stepgen.h"
+#include "mod_planner.h"
+
+
+
+
+#define AX axis[a]                                      // current axis
+#define BLOCK(n) queue[(head + (n)) % PLANNER_QUEUE_SIZE] // n-th block from the head
+
+
+
+
+// private vars
+
+static planner_axis_t axis[PLANNER_AXES_CNT] = {0}; // array of axes data
+static planner_block_t queue[PLANNER_QUEUE_SIZE] = {0}; // segments queue
+static uint8_t msg_buf[PLANNER_MSG_BUF_LEN] = {0}; // message buffer
+
+static uint8_t head = 0, cnt = 0; // queue head and number of blocks
+static uint8_t busy = 0; // head block is executing
+static uint64_t pos = 0; // position inside of the head block (steps, Q16)
+static uint32_t vel = 0; // current velocity (steps/slice, Q16)
+
+static uint32_t slice_ticks = 0, junction_dev = 0;
+
+static uint8_t kins = PLANNER_KINS_TRIVIAL; // kinematics type
+static int32_t tower_x[3] = {0}, tower_y[3] = {0}; // delta towers positions (in steps)
+static uint64_t arm2 = 0; // delta arm length ^ 2 (in steps^2)
+
+
+
+
+// private functions
+
+static uint32_t isqrt64(uint64_t x)
+{
+    uint64_t r = 0, b = (uint64_t)1 << 62;
+
+    while ( b > x ) b >>= 2;
+
+    for ( ; b; b >>= 2 )
+    {
+        if ( x >= r + b ) { x -= r + b; r = (r >> 1) + b; }
+        else r >>= 1;
+    }
+
+    return (uint32_t) r;
+}
+
+static uint32_t ns_to_ticks(uint32_t ns)
+{
+    return (uint32_t) ( (uint64_t)ns * (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+}
+
+// v * slice_ticks / TIMER_FREQUENCY, without 64-bit overflow
+static uint64_t per_slice(uint64_t v)
+{
+    return (v / TIMER_FREQUENCY) * slice_ticks +
+        (v % TIMER_FREQUENCY) * slice_ticks / TIMER_FREQUENCY;
+}
+
+// v2 + 2*accel*dist, saturated
+static uint64_t v2_reach(uint64_t v2, uint32_t accel, uint64_t dist)
+{
+    uint64_t dv2;
+
+    if ( accel && dist > (UINT64_MAX >> 2) / accel ) return UINT64_MAX >> 1;
+
+    dv2 = 2 * (uint64_t)accel * dist;
+
+    return v2 > (UINT64_MAX >> 1) - dv2 ? UINT64_MAX >> 1 : v2 + dv2;
+}
+
+static uint64_t junction_v2(planner_block_t * p, planner_block_t * b)
+{
+    uint8_t a;
+    int64_t dot = 0;
+    int32_t cos_q;
+    uint32_t sin_q, accel;
+    uint64_t x;
+
+    for ( a = PLANNER_AXES_CNT; a--; ) dot += (int64_t)p->unit[a] * (int64_t)b->unit[a];
+
+    // cos of the angle between exit of the previous and entry of the new segment
+    cos_q = (int32_t)( -(dot >> 15) );
+
+    if ( cos_q >= 32767 ) return 0; // full reversal
+    if ( cos_q <= -32767 ) return UINT64_MAX; // straight line
+
+    // sin(theta/2) = sqrt((1 - cos(theta)) / 2), Q15
+    sin_q = isqrt64( (uint64_t)(32768 - cos_q) << 14 );
+    if ( sin_q >= 32768 ) return UINT64_MAX;
+
+    accel = p->accel < b->accel ? p->accel : b->accel;
+    x = (uint64_t)accel * (uint64_t)junction_dev;
+    if ( x > (UINT64_MAX >> 16) ) return UINT64_MAX;
+
+    return x * sin_q / (32768 - sin_q);
+}
+
+// Q4 value rounded to the nearest integer
+static int32_t q4_round(int32_t v)
+{
+    return v < 0 ? -((-v + 8) >> 4) : (v + 8) >> 4;
+}
+
+// delta carriages positions of the cartesian position, both in 1/16 steps (Q4)
+static void delta_get(int32_t * cart, int32_t * motor)
+{
+    uint8_t t;
+    int64_t dx, dy, r2;
+
+    // carriage height = z + sqrt(arm^2 - dx^2 - dy^2)
+    for ( t = 3; t--; )
+    {
+        dx = (int64_t)cart[0] - ((int64_t)tower_x[t] << 4);
+        dy = (int64_t)cart[1] - ((int64_t)tower_y[t] << 4);
+        r2 = (int64_t)(arm2 << 8) - dx*dx - dy*dy;
+        if ( r2 < 0 ) r2 = 0;
+        motor[t] = cart[2] + (int32_t)isqrt64((uint64_t)r2);
+    }
+}
+
+// motors positions (in steps) of the cartesian position (in 1/16 steps)
+static void motors_get(int32_t * cart, int32_t * motor)
+{
+    uint8_t a;
+
+    for ( a = PLANNER_AXES_CNT; a--; ) motor[a] = q4_round(cart[a]);
+
+    switch ( kins )
+    {
+        case PLANNER_KINS_COREXY:
+        case PLANNER_KINS_HBOT:
+            motor[0] = q4_round(cart[0] + cart[1]);
+            motor[1] = q4_round(cart[0] - cart[1]);
+            break;
+
+        case PLANNER_KINS_DELTA:
+            delta_get(cart, motor);
+            for ( a = 3; a--; ) motor[a] = q4_round(motor[a]);
+            break;
+    }
+}
+
+// number of sub-slices (as a power of 2, up to `max`) to keep the delta chord within a quarter step
+static uint8_t delta_split(int32_t * cart, uint8_t max)
+{
+    uint8_t a, shift;
+    int32_t last[PLANNER_AXES_CNT], mid[PLANNER_AXES_CNT], m0[3], m1[3], m2[3];
+    uint32_t e, e_max = 0;
+
+    for ( a = PLANNER_AXES_CNT; a--; )
+    {
+        last[a] = AX.cart;
+        mid[a] = AX.cart + (cart[a] - AX.cart) / 2;
+    }
+
+    delta_get(last, m0);
+    delta_get(mid, m1);
+    delta_get(cart, m2);
+
+    // chord error at the middle is (2*m1 - m0 - m2) / 2, it drops 4 times per split
+    for ( a = 3; a--; )
+    {
+        e = (uint32_t)( 2*m1[a] - m0[a] - m2[a] < 0 ? m0[a] + m2[a] - 2*m1[a] : 2*m1[a] - m0[a] - m2[a] );
+        if ( e > e_max ) e_max = e;
+    }
+
+    for ( shift = 0; e_max > 8 && (2U << shift) <= max; shift++ ) e_max >>= 2;
+
+    return shift;
+}
+
+// max velocity and acceleration of the block, limited by the motors of the kinematics
+static void motors_limits(planner_block_t * b, uint64_t * v, uint64_t * accel)
+{
+    uint8_t a, k, t;
+    int32_t p[3];
+    int64_t dx, dy, r2, w;
+    uint32_t ratio[3] = {0}, kappa[3] = {0}, r, d, uw;
+    uint64_t lim, v2;
+
+    switch ( kins )
+    {
+        case PLANNER_KINS_COREXY:
+        case PLANNER_KINS_HBOT:
+            // motor steps per path step, Q15
+            d = (uint32_t)( b->unit[0] + b->unit[1] < 0 ? -(b->unit[0] + b->unit[1]) : b->unit[0] + b->unit[1] );
+            ratio[0] = d;
+            d = (uint32_t)( b->unit[0] - b->unit[1] < 0 ? -(b->unit[0] - b->unit[1]) : b->unit[0] - b->unit[1] );
+            ratio[1] = d;
+            break;
+
+        case PLANNER_KINS_DELTA:
+            // check the start, the middle and the end of the block
+            for ( k = 3; k--; )
+            {
+                for ( a = 3; a--; )
+                {
+                    p[a] = AX.base + b->steps[a] / 2 * k;
+                    for ( t = 0; t < cnt; t++ ) p[a] += BLOCK(t).steps[a];
+                }
+
+                for ( t = 3; t--; )
+                {
+                    dx = (int64_t)p[0] - tower_x[t];
+                    dy = (int64_t)p[1] - tower_y[t];
+                    r2 = (int64_t)arm2 - dx*dx - dy*dy;
+                    r = r2 > 0 ? isqrt64((uint64_t)r2) : 0;
+                    if ( !r ) r = 1;
+
+                    // carriage velocity per path velocity = uz - (dx*ux + dy*uy) / r, Q15
+                    w = dx * b->unit[0] + dy * b->unit[1];
+                    uw = (uint32_t)( (uint64_t)(w < 0 ? -w : w) / r );
+                    if ( uw > (1U << 24) ) uw = 1U << 24;
+                    w = (int64_t)b->unit[2] - (w < 0 ? -(int64_t)uw : (int64_t)uw);
+                    d = (uint32_t)( w < 0 ? -w : w );
+                    if ( d > ratio[t] ) ratio[t] = d;
+
+                    // carriage acceleration per path velocity^2 = (ux^2 + uy^2 + (w/r)^2) / r, Q30
+                    lim = ( (uint64_t)((int64_t)b->unit[0] * b->unit[0] + (int64_t)b->unit[1] * b->unit[1]) +
+                        (uint64_t)uw * uw ) / r;
+                    if ( lim > UINT32_MAX ) lim = UINT32_MAX;
+                    if ( lim > kappa[t] ) kappa[t] = (uint32_t)lim;
+                }
+            }
+            break;
+    }
+
+    for ( a = 3; a--; )
+    {
+        if ( !AX.enabled ) continue;
+
+        if ( ratio[a] )
+        {
+            lim = (uint64_t)AX.max_vel * 32768 / ratio[a];
+            if ( lim < *v ) *v = lim;
+        }
+
+        // curved path of the carriage takes a half of its max acceleration
+        if ( kappa[a] )
+        {
+            lim = isqrt64( ((uint64_t)AX.max_accel << 29) / kappa[a] );
+            if ( lim < *v ) *v = lim;
+        }
+
+        if ( ratio[a] )
+        {
+            v2 = (*v * *v * kappa[a]) >> 30;
+            lim = ((uint64_t)AX.max_accel - (v2 < AX.max_accel ? v2 : AX.max_accel)) * 32768 / ratio[a];
+            if ( lim < *accel ) *accel = lim;
+        }
+    }
+}
+
+static void recalculate()
+{
+    uint8_t n;
+    uint64_t v2 = 0; // exit of the last block
+
+    // backward pass, the executing block can't be changed
+    for ( n = cnt; n-- > busy; )
+    {
+        v2 = v2_reach(v2, BLOCK(n).accel, (uint64_t)BLOCK(n).length << 16);
+        if ( v2 > BLOCK(n).v2_entry_max ) v2 = BLOCK(n).v2_entry_max;
+        BLOCK(n).v2_entry = v2;
+    }
+
+    // forward pass, starting from the current velocity
+    if ( busy )
+    {
+        v2 = v2_reach((uint64_t)vel * vel, BLOCK(0).accel,
+            ((uint64_t)BLOCK(0).length << 16) - pos);
+    }
+    else
+    {
+        BLOCK(0).v2_entry = 0;
+        v2 = v2_reach(0, BLOCK(0).accel, (uint64_t)BLOCK(0).length << 16);
+    }
+
+    for ( n = 1; n < cnt; n++ )
+    {
+        if ( BLOCK(n).v2_entry > v2 ) BLOCK(n).v2_entry = v2;
+        v2 = v2_reach(BLOCK(n).v2_entry, BLOCK(n).accel, (uint64_t)BLOCK(n).length << 16);
+    }
+}
+
+// send a motors path part of the slice to the stepgen channels
+static void part_send(int32_t * cart, uint32_t ticks, uint8_t max)
+{
+    uint8_t a, shift;
+    uint32_t i, t;
+    int32_t sub[PLANNER_AXES_CNT], motor[PLANNER_AXES_CNT];
+
+    // delta carriages path is curved, split the part if needed
+    shift = kins == PLANNER_KINS_DELTA ? delta_split(cart, max) : 0;
+
+    for ( i = 1; i <= (1U << shift); i++ )
+    {
+        for ( a = PLANNER_AXES_CNT; a--; ) sub[a] = AX.cart + (cart[a] - AX.cart) * (int32_t)i / (int32_t)(1U << shift);
+
+        motors_get(sub, motor);
+
+        // the last sub-slice gets the rest of ticks
+        t = i < (1U << shift) ? ticks >> shift : ticks - (ticks >> shift) * ((1U << shift) - 1);
+
+        for ( a = PLANNER_AXES_CNT; a--; )
+        {
+            if ( !AX.enabled ) continue;
+
+            // steps of the failed slice go to the next one
+            if ( !stepgen_slice_add(AX.ch, motor[a] - AX.done, t) ) AX.done = motor[a];
+        }
+    }
+
+    for ( a = PLANNER_AXES_CNT; a--; ) AX.cart = cart[a];
+}
+
+static void slice()
+{
+    uint8_t a, corner = 0;
+    uint32_t v1, t0 = 0;
+    uint64_t v2, ds, f, length = (uint64_t)BLOCK(0).length << 16;
+    int32_t cart[PLANNER_AXES_CNT], corner_cart[PLANNER_AXES_CNT];
+
+    // max velocity at the end of this slice
+    v2 = v2_reach(cnt > 1 ? BLOCK(1).v2_entry : 0, BLOCK(0).accel, length - pos);
+    if ( v2 > BLOCK(0).v2_nominal ) v2 = BLOCK(0).v2_nominal;
+    v1 = isqrt64(v2);
+    if ( v1 > vel + BLOCK(0).accel ) v1 = vel + BLOCK(0).accel;
+
+    ds = ((uint64_t)vel + (uint64_t)v1) / 2;
+    if ( !ds ) ds = 1;
+
+    vel = v1;
+
+    // ticks till the end of the current block
+    if ( pos + ds >= length ) t0 = (uint32_t)( (((length - pos) << 16) / ds * slice_ticks) >> 16 );
+
+    pos += ds;
+
+    // go through all completed blocks
+    while ( pos >= length )
+    {
+        pos -= length;
+        for ( a = PLANNER_AXES_CNT; a--; ) AX.base += BLOCK(0).steps[a];
+
+        // 1st corner of this slice
+        if ( !corner++ ) for ( a = PLANNER_AXES_CNT; a--; ) corner_cart[a] = AX.base << 4;
+
+        head = (head + 1) % PLANNER_QUEUE_SIZE;
+        if ( !(--cnt) ) break;
+
+        length = (uint64_t)BLOCK(0).length << 16;
+    }
+
+    // part of the block done, Q32
+    f = cnt ? (pos << 16) / BLOCK(0).length : 0;
+
+    // cartesian position at the end of this slice, in 1/16 steps
+    for ( a = PLANNER_AXES_CNT; a--; )
+    {
+        cart[a] = AX.base << 4;
+
+        if ( cnt )
+        {
+            cart[a] += BLOCK(0).steps[a] < 0 ?
+                -(int32_t)( ((uint64_t)(-BLOCK(0).steps[a]) * f + (1U << 27)) >> 28 ) :
+                 (int32_t)( ((uint64_t)( BLOCK(0).steps[a]) * f + (1U << 27)) >> 28 );
+        }
+    }
+
+    // a corner inside of the slice? go through it
+    if ( corner && t0 && t0 < slice_ticks )
+    {
+        part_send(corner_cart, t0, PLANNER_SUBSLICES / 2);
+        part_send(cart, slice_ticks - t0, PLANNER_SUBSLICES / 2);
+    }
+    else part_send(cart, slice_ticks, PLANNER_SUBSLICES);
+
+    // all blocks done?
+    if ( !cnt ) { busy = 0; pos = 0; vel = 0; }
+}
+
+
+
+
+// public methods
+
+/**
+ * @brief   module init
+ * @note    call this function only once before planner_module_base_thread()
+ * @retval  none
+ */
+void planner_module_init()
+{
+    // set default timings
+    planner_setup(PLANNER_SLICE_TIME, 0);
+
+    // add message handlers
+    uint8_t i = 0;
+    for ( i = PLANNER_MSG_AXIS_SETUP; i < PLANNER_MSG_CNT; i++ )
+    {
+        msg_recv_callback_add(i, (msg_recv_func_t) planner_msg_recv);
+    }
+}
+
+/**
+ * @brief   module base thread
+ * @note    call this function in the main loop, before stepgen_module_base_thread()
+ * @retval  none
+ */
+void planner_module_base_thread()
+{
+    uint8_t a, sub = kins == PLANNER_KINS_DELTA ? PLANNER_SUBSLICES : 1;
+    int32_t cart[PLANNER_AXES_CNT], motor[PLANNER_AXES_CNT];
+
+    // nothing to do?
+    if ( !cnt ) return;
+
+    // stepgen watchdog has aborted all channels?
+    if ( stepgen_watchdog_expired() ) { planner_abort(); return; }
+
+    // all axes are ready for the next slice?
+    for ( a = PLANNER_AXES_CNT; a--; )
+    {
+        if ( !AX.enabled ) continue;
+        if ( stepgen_fifo_free_get(AX.ch) < sub ) return;
+    }
+
+    // start of the motion?
+    if ( !busy )
+    {
+        for ( a = PLANNER_AXES_CNT; a--; ) cart[a] = AX.base << 4;
+        motors_get(cart, motor);
+        for ( a = PLANNER_AXES_CNT; a--; ) { AX.done = motor[a]; AX.cart = cart[a]; }
+
+        busy = 1;
+        pos = 0;
+        vel = 0;
+        recalculate();
+    }
+
+    slice();
+}
+
+
+
+
+/**
+ * @brief   setup the planner axis
+ *
+ * @param   a           axis id
+ * @param   c           stepgen channel id
+ * @param   max_vel     max axis velocity (in steps per second), 0 = disable axis
+ * @param   max_accel   max axis acceleration (in steps per second^2)
+ *
+ * @note    the stepgen channel pins must be set up with stepgen_pin_setup()
+ *
+ * @retval  none
+ */
+void planner_axis_setup(uint8_t a, uint8_t c, uint32_t max_vel, uint32_t max_accel)
+{
+    if ( cnt ) return;
+
+    AX.enabled = max_vel && max_accel ? 1 : 0;
+    AX.ch = c;
+    AX.max_vel = max_vel;
+    AX.max_accel = max_accel;
+}
+
+/**
+ * @brief   setup the planner timings
+ *
+ * @param   slice_time          duration of the single motion slice (in nanoseconds)
+ * @param   junction_deviation  junction deviation (in 1/1000 of step)
+ *
+ * @note    DIR timings are taken from the stepgen channels, see stepgen_dir_setup()
+ * @note    a delta slice takes up to PLANNER_SUBSLICES tasks of every stepgen channel,
+ *          they keep the carriages path within one step of the exact one
+ *          for the slices up to ~20 ms
+ *
+ * @retval  none
+ */
+void planner_setup(uint32_t slice_time, uint32_t junction_deviation)
+{
+    if ( cnt ) return;
+
+    slice_ticks = ns_to_ticks(slice_time);
+    junction_dev = (uint32_t) ( ((uint64_t)junction_deviation << 16) / 1000 );
+}
+
+/**
+ * @brief   setup the planner kinematics
+ *
+ * @param   type    PLANNER_KINS_TRIVIAL, PLANNER_KINS_COREXY, PLANNER_KINS_HBOT or PLANNER_KINS_DELTA
+ * @param   radius  delta towers radius (in steps)
+ * @param   arm     delta arm length (in steps)
+ *
+ * @note    CoreXY and H-bot use axes 0 and 1 (X, Y) to drive motors 0 and 1.
+ *          Delta uses axes 0, 1, 2 (X, Y, Z) to drive the carriages 0, 1, 2,
+ *          all 3 axes must have the same steps per unit.
+ *          Velocity and acceleration limits of the axis are applied to the cartesian axis
+ *          and to the motor with the same id.
+ *
+ * @retval  none
+ */
+void planner_kinematics_setup(uint8_t type, uint32_t radius, uint32_t arm)
+{
+    if ( cnt ) return;
+
+    kins = type < PLANNER_KINS_CNT ? type : PLANNER_KINS_TRIVIAL;
+
+    // towers at 210, 330 and 90 degrees, cos/sin are Q15
+    tower_x[0] = -(int32_t)( (int64_t)radius * 28378 >> 15 );
+    tower_y[0] = -(int32_t)( radius / 2 );
+    tower_x[1] =  (int32_t)( (int64_t)radius * 28378 >> 15 );
+    tower_y[1] = -(int32_t)( radius / 2 );
+    tower_x[2] = 0;
+    tower_y[2] = (int32_t)radius;
+
+    arm2 = (uint64_t)arm * arm;
+}
+
+/**
+ * @brief   set the cartesian position of the planner axes
+ *
+ * @param   pos     pointer to the array of PLANNER_AXES_CNT axes positions (in steps)
+ *
+ * @note    use it after homing or after planner_abort()
+ *
+ * @retval  none
+ */
+void planner_pos_set(int32_t * pos)
+{
+    uint8_t a;
+
+    if ( cnt ) return;
+
+    for ( a = PLANNER_AXES_CNT; a--; ) AX.base = pos[a];
+}
+
+
+
+
+/**
+ * @brief   add a new linear segment to the queue
+ *
+ * @param   vel     requested velocity along the path (in steps per second)
+ * @param   steps   pointer to the array of PLANNER_AXES_CNT relative axes positions
+ *                  (max 2^30 steps per axis)
+ *
+ * @retval   0 (segment added)
+ * @retval  -1 (queue is full or segment is invalid)
+ */
+int8_t planner_line_add(uint32_t vel, int32_t * steps)
+{
+    uint8_t a;
+    uint32_t d;
+    uint64_t sum = 0, v = vel, accel = UINT32_MAX, lim;
+    planner_block_t * b = &BLOCK(cnt);
+
+    if ( cnt >= PLANNER_QUEUE_SIZE || !vel ) return -1;
+
+    // segment length
+    for ( a = PLANNER_AXES_CNT; a--; )
+    {
+        b->steps[a] = AX.enabled ? steps[a] : 0;
+        d = b->steps[a] < 0 ? -b->steps[a] : b->steps[a];
+        sum += (uint64_t)d * d;
+    }
+
+    if ( !sum ) return 0; // zero length segment
+
+    b->length = isqrt64(sum);
+    if ( !b->length ) b->length = 1;
+
+    // unit vector and axes limits
+    for ( a = PLANNER_AXES_CNT; a--; )
+    {
+        d = b->steps[a] < 0 ? -b->steps[a] : b->steps[a];
+        b->unit[a] = (int32_t) ( (uint64_t)d * 32768 / b->length );
+        if ( b->steps[a] < 0 ) b->unit[a] = -b->unit[a];
+        if ( !d ) continue;
+
+        lim = (uint64_t)AX.max_vel * b->length / d;
+        if ( lim < v ) v = lim;
+        lim = (uint64_t)AX.max_accel * b->length / d;
+        if ( lim < accel ) accel = lim;
+    }
+
+    // motors limits of the kinematics
+    if ( kins != PLANNER_KINS_TRIVIAL ) motors_limits(b, &v, &accel);
+    if ( !accel ) accel = 1;
+
+    v = per_slice(v << 16);
+    if ( v > UINT32_MAX ) v = UINT32_MAX;
+
+    b->v2_nominal = v * v;
+    b->accel = (uint32_t) per_slice(per_slice(accel << 16));
+    if ( !b->accel ) b->accel = 1;
+
+    // max entry velocity
+    b->v2_entry_max = cnt ? junction_v2(&BLOCK(cnt - 1), b) : 0;
+    if ( b->v2_entry_max > b->v2_nominal ) b->v2_entry_max = b->v2_nominal;
+    if ( cnt && b->v2_entry_max > BLOCK(cnt - 1).v2_nominal )
+        b->v2_entry_max = BLOCK(cnt - 1).v2_nominal;
+    b->v2_entry = 0;
+
+    cnt++;
+    recalculate();
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief   abort all segments and stop all planner axes
+ * @note    the axes positions are lost, use planner_pos_set() for the non trivial kinematics
+ * @retval  none
+ */
+void planner_abort()
+{
+    uint8_t a;
+
+    for ( a = PLANNER_AXES_CNT; a--; ) if ( AX.enabled ) stepgen_abort(AX.ch, 1);
+
+    head = 0;
+    cnt = 0;
+    busy = 0;
+    pos = 0;
+    vel = 0;
+}
+
+
+
+
+/**
+ * @brief   get number of free segment slots
+ * @retval  0..PLANNER_QUEUE_SIZE
+ */
+uint8_t planner_queue_free_get()
+{
+    return PLANNER_QUEUE_SIZE - cnt;
+}
+
+/**
+ * @brief   get planner state
+ * @retval  0 (planner is idle)
+ * @retval  1 (planner is busy)
+ */
+uint8_t planner_state_get()
+{
+    return cnt ? 1 : 0;
+}
+
+
+
+
+/**
+ * @brief   "message received" callback
+ *
+ * @note    this function will be called automatically
+ *          when a new message will arrive for this module.
+ *
+ * @param   type    user defined message type (0..0xFF)
+ * @param   msg     pointer to the message buffer
+ * @param   length  the length of a message (0 .. MSG_LEN)
+ *
+ * @retval   0 (message read)
+ * @retval  -1 (message not read)
+ */
+int8_t volatile planner_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
+{
+    u32_10_t *in = (u32_10_t*) msg;
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    switch (type)
+    {
+        case PLANNER_MSG_AXIS_SETUP:
+            planner_axis_setup(in->v[0], in->v[1], in->v[2], in->v[3]);
+            break;
+        case PLANNER_MSG_SETUP:
+            planner_setup(in->v[0], in->v[1]);
+            break;
+        case PLANNER_MSG_LINE_ADD:
+            planner_line_add(in->v[0], (int32_t*) &in->v[1]);
+            break;
+        case PLANNER_MSG_ABORT:
+            planner_abort();
+            break;
+        case PLANNER_MSG_STATE_GET:
+            out->v[0] = planner_state_get();
+            out->v[1] = planner_queue_free_get();
+            msg_send(type, msg_buf, 8);
+            break;
+        case PLANNER_MSG_KINEMATICS_SETUP:
+            planner_kinematics_setup(in->v[0], in->v[1], in->v[2]);
+            break;
+        case PLANNER_MSG_POS_SET:
+            planner_pos_set((int32_t*) &in->v[0]);
+            break;
+
+        default: return -1;
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+    @example mod_planner.c
+
+    <b>Usage example 1</b>: two blended XY segments with a 90 degree corner
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_stepgen.h"
+        #include "mod_planner.h"
+
+        int main(void)
+        {
+            int32_t line1[PLANNER_AXES_CNT] = {4000, 0, 0, 0, 0, 0};
+            int32_t line2[PLANNER_AXES_CNT] = {0, 4000, 0, 0, 0, 0};
+
+            // modules init
+            stepgen_module_init();
+            planner_module_init();
+
+            // STEP/DIR pins of the X and Y axes
+            stepgen_pin_setup(0, 0, PA, 3, 0);
+            stepgen_pin_setup(0, 1, PA, 5, 0);
+            stepgen_pin_setup(1, 0, PA, 6, 0);
+            stepgen_pin_setup(1, 1, PA, 7, 0);
+
+            // 50 kHz max rate, 200000 steps/s^2 max acceleration
+            planner_axis_setup(0, 0, 50000, 200000);
+            planner_axis_setup(1, 1, 50000, 200000);
+
+            // 1 ms slices, 0.5 step junction deviation
+            planner_setup(1000000, 500);
+
+            // 40 kHz along the path
+            planner_line_add(40000, line1);
+            planner_line_add(40000, line2);
+
+            // main loop
+            for(;;)
+            {
+                planner_module_base_thread();
+                stepgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
+*/
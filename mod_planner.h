@@ -0,0 +1,96 @@
+/**
+ * @file    mod_planner.h
+ * @brief   look-ahead motion planner module header
+ * This module implements an API to make blended multi-axis moves
+ * using the stepgen channels as outputs
+ */
+
+#ifndef _MOD_PLANNER_H
+#define _MOD_PLANNER_H
+
+#include <stdint.h>
+#include "mod_msg.h"
+#include "mod_timer.h"
+
+
+
+
+#define PLANNER_AXES_CNT        6   ///< maximum number of planner axes
+#define PLANNER_QUEUE_SIZE      16  ///< size of the segments queue
+#define PLANNER_MSG_BUF_LEN     MSG_LEN
+
+#define PLANNER_SLICE_TIME      1000000 ///< default slice duration (in nanoseconds)
+#define PLANNER_SUBSLICES       4   ///< max number of the delta sub-slices of one slice
+
+enum
+{
+    PLANNER_MSG_AXIS_SETUP = 0x40,
+    PLANNER_MSG_SETUP,
+    PLANNER_MSG_LINE_ADD,
+    PLANNER_MSG_ABORT,
+    PLANNER_MSG_STATE_GET,
+    PLANNER_MSG_KINEMATICS_SETUP,
+    PLANNER_MSG_POS_SET,
+    PLANNER_MSG_CNT
+};
+
+/// kinematics types
+enum
+{
+    PLANNER_KINS_TRIVIAL, // axis = motor
+    PLANNER_KINS_COREXY, // motor0 = X + Y, motor1 = X - Y
+    PLANNER_KINS_HBOT, // same motors equations as CoreXY
+    PLANNER_KINS_DELTA, // X, Y, Z to the carriages of the towers at 210, 330 and 90 degrees
+    PLANNER_KINS_CNT
+};
+
+
+
+
+typedef struct
+{
+    uint8_t     enabled;
+    uint8_t     ch; // stepgen channel id
+
+    uint32_t    max_vel; // steps/s, for the cartesian axis and for its motor
+    uint32_t    max_accel; // steps/s^2
+
+    int32_t     base; // cartesian position at the start of current segment (in steps)
+    int32_t     done; // motor position already sent to the stepgen channel
+    int32_t     cart; // cartesian position at the end of the last slice (in 1/16 steps)
+
+} planner_axis_t;
+
+typedef struct
+{
+    int32_t     steps[PLANNER_AXES_CNT];
+    int32_t     unit[PLANNER_AXES_CNT]; // unit vector, Q15
+
+    uint32_t    length; // in steps
+    uint32_t    accel; // steps/slice^2, Q16
+
+    uint64_t    v2_nominal; // (steps/slice)^2, Q32
+    uint64_t    v2_entry_max;
+    uint64_t    v2_entry;
+
+} planner_block_t;
+
+
+
+
+void planner_module_init();
+void planner_module_base_thread();
+void planner_axis_setup(uint8_t a, uint8_t c, uint32_t max_vel, uint32_t max_accel);
+void planner_setup(uint32_t slice_time, uint32_t junction_deviation);
+void planner_kinematics_setup(uint8_t type, uint32_t radius, uint32_t arm);
+void planner_pos_set(int32_t * pos);
+int8_t planner_line_add(uint32_t vel, int32_t * steps);
+void planner_abort();
+uint8_t planner_queue_free_get();
+uint8_t planner_state_get();
+int8_t volatile planner_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
+
+
+
+
+#endif
@@ -0,0 +1,244 @@
+/**
+ * @file    mod_pool.c
+ * @brief   shared task records pool module
+ * This module implements an API to store tasks of the real-time channels
+ * in one common pool of records linked into the per-channel queues
+ */
+
+#include "mod_pool.h"
+
+
+
+
+// public vars
+
+pool_rec_t pool[POOL_SIZE] = {{0}}; // records, pool[POOL_NONE] is never used
+
+
+
+
+// private vars
+
+static uint8_t msg_buf[POOL_MSG_BUF_LEN] = {0}; // message buffer
+static uint16_t free_head = POOL_NONE; // list of the released records
+static uint16_t top = POOL_NONE + 1; // 1st record which was never used
+static uint16_t free_cnt = POOL_SIZE - 1;
+static uint16_t free_min = POOL_SIZE - 1;
+static uint16_t reserved = 0; // records reserved to the queues
+static uint16_t spare_used = 0; // records taken by the queues over their reserve
+
+
+
+
+// public methods
+
+/**
+ * @brief   module init
+ * @note    call this function only once before any other module init
+ * @retval  none
+ */
+void pool_module_init()
+{
+    uint8_t i = 0;
+
+    // add message handlers
+    for ( i = POOL_MSG_STATE_GET; i < POOL_MSG_CNT; i++ )
+    {
+        msg_recv_callback_add(i, (msg_recv_func_t) pool_msg_recv);
+    }
+}
+
+
+
+
+/**
+ * @brief   reserve records to the queue
+ * @param   q   pointer to the empty queue
+ * @param   min number of records which are always available for this queue
+ * @note    call this function once for every queue, from the module init,
+ *          the reserve is cut to the records left out of the POOL_RESERVE
+ * @retval  none
+ */
+void pool_queue_init(pool_queue_t * q, uint16_t min)
+{
+    if ( min > POOL_RESERVE - reserved ) min = POOL_RESERVE - reserved;
+    reserved += min;
+    q->min = min;
+}
+
+/**
+ * @brief   add a new record to the end of the queue
+ * @param   q   pointer to the queue
+ * @note    all record fields are zero, except the `next`
+ * @retval  pointer to the record
+ * @retval  0 (no free records for this queue)
+ */
+pool_rec_t * pool_put(pool_queue_t * q)
+{
+    static uint16_t r;
+
+    // queue is over its reserve and all spare records are used?
+    if ( q->cnt >= q->min && spare_used >= POOL_SPARE ) return 0;
+
+    // take a released record or a never used one
+    if ( free_head != POOL_NONE ) { r = free_head; free_head = pool[r].next; }
+    else if ( top < POOL_SIZE ) r = top++;
+    else return 0;
+
+    if ( --free_cnt < free_min ) free_min = free_cnt;
+    if ( q->cnt >= q->min ) spare_used++;
+
+    pool[r].next = POOL_NONE;
+    pool[r].type = 0;
+    pool[r].dir = 0;
+    pool[r].pulses = 0;
+    pool[r].low_ticks = 0;
+    pool[r].high_ticks = 0;
+    pool[r].delay_ticks = 0;
+
+    // link the record to the end of the queue
+    if ( q->head == POOL_NONE ) q->head = r;
+    else pool[q->tail].next = r;
+    q->tail = r;
+    q->cnt++;
+
+    return &pool[r];
+}
+
+/**
+ * @brief   release the 1st record of the queue
+ * @param   q   pointer to the queue
+ * @retval  none
+ */
+void pool_drop(pool_queue_t * q)
+{
+    static uint16_t r;
+
+    r = q->head;
+    if ( r == POOL_NONE ) return;
+
+    q->head = pool[r].next;
+    if ( q->head == POOL_NONE ) q->tail = POOL_NONE;
+    if ( q->cnt > q->min ) spare_used--;
+    q->cnt--;
+
+    pool[r].pulses = 0;
+    pool[r].next = free_head;
+    free_head = r;
+    free_cnt++;
+}
+
+/**
+ * @brief   release all records of the queue
+ * @param   q   pointer to the queue
+ * @retval  none
+ */
+void pool_clear(pool_queue_t * q)
+{
+    while ( q->head != POOL_NONE ) pool_drop(q);
+}
+
+
+
+
+/**
+ * @brief   get number of free records
+ * @retval  0..(POOL_SIZE-1)
+ */
+uint16_t pool_free_get()
+{
+    return free_cnt;
+}
+
+/**
+ * @brief   get the lowest number of free records since the start
+ * @retval  0..(POOL_SIZE-1)
+ */
+uint16_t pool_free_min_get()
+{
+    return free_min;
+}
+
+/**
+ * @brief   get number of records the queue can take
+ * @param   q   pointer to the queue
+ * @retval  0..(POOL_SIZE-1), unused records of the queue reserve and free spare records
+ */
+uint16_t pool_avail_get(pool_queue_t * q)
+{
+    return (q->cnt < q->min ? q->min - q->cnt : 0) + POOL_SPARE - spare_used;
+}
+
+
+
+
+/**
+ * @brief   "message received" callback
+ *
+ * @note    this function will be called automatically
+ *          when a new message will arrive for this module.
+ *
+ * @param   type    user defined message type (0..0xFF)
+ * @param   msg     pointer to the message buffer
+ * @param   length  the length of a message (0 .. MSG_LEN)
+ *
+ * @retval   0 (message read)
+ * @retval  -1 (message not read)
+ */
+int8_t volatile pool_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
+{
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    switch (type)
+    {
+        case POOL_MSG_STATE_GET: // memory report
+            out->v[0] = POOL_SIZE - 1;
+            out->v[1] = pool_free_get();
+            out->v[2] = pool_free_min_get();
+            out->v[3] = sizeof(pool_rec_t);
+            out->v[4] = sizeof(pool);
+            out->v[5] = POOL_SPARE - spare_used;
+            msg_send(type, msg_buf, 6*4);
+            break;
+
+        default: return -1;
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+    @example mod_pool.c
+
+    <b>Usage example 1</b>: queue of the channel tasks
+
+    @code
+        #include <stdint.h>
+        #include "mod_pool.h"
+
+        static pool_queue_t queue = {0};
+
+        int main(void)
+        {
+            pool_rec_t * rec;
+
+            // module init
+            pool_module_init();
+
+            // 4 records are always available for this queue
+            pool_queue_init(&queue, 4);
+
+            // add a new task to the queue
+            rec = pool_put(&queue);
+            if ( rec ) rec->pulses = 100;
+
+            // current task is done
+            if ( queue.head != POOL_NONE ) pool_drop(&queue);
+
+            return 0;
+        }
+    @endcode
+*/
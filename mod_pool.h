@@ -0,0 +1,83 @@
+/**
+ * @file    mod_pool.h
+ * @brief   shared task records pool module header
+ * This module implements an API to store tasks of the real-time channels
+ * in one common pool of records linked into the per-channel queues.
+ * Every queue has its own reserve of records, so a busy channel can't
+ * take the records of other channels, and the queues over the reserve
+ * share the spare records.
+ */
+
+#ifndef _MOD_POOL_H
+#define _MOD_POOL_H
+
+#include <stdint.h>
+#include "mod_msg.h"
+
+
+
+
+#if USE_PULSGEN
+#define POOL_RESERVE        (24*4 + 32*1) ///< records reserved to the queues (stepgen 24 x 4, pulsgen 32 x 1)
+#else
+#define POOL_RESERVE        (24*4) ///< records reserved to the queues (stepgen 24 x 4)
+#endif
+#define POOL_SPARE          24  ///< records shared by the queues over their reserve
+#define POOL_SIZE           (POOL_RESERVE + POOL_SPARE + 1) ///< total number of task records (121 or 153 x 20 bytes)
+#define POOL_NONE           0   ///< "no record" id, this record is always empty
+#define POOL_MSG_BUF_LEN    MSG_LEN
+
+enum
+{
+    POOL_MSG_STATE_GET = 0x50,
+    POOL_MSG_CNT
+};
+
+
+
+
+/// a task record
+typedef struct
+{
+    uint16_t    next; // next record in the queue or in the free list
+    uint8_t     type;
+    uint8_t     dir;
+    uint32_t    pulses;
+    uint32_t    low_ticks;
+    uint32_t    high_ticks;
+    uint32_t    delay_ticks;
+
+} pool_rec_t;
+
+/// a channel queue of task records
+typedef struct
+{
+    uint16_t    head; // current task, POOL_NONE if empty (zero init is fine)
+    uint16_t    tail; // last added task
+    uint16_t    cnt; // number of records in the queue
+    uint16_t    min; // number of records reserved to the queue
+
+} pool_queue_t;
+
+
+
+
+extern pool_rec_t pool[POOL_SIZE];
+
+
+
+
+void pool_module_init();
+void pool_queue_init(pool_queue_t * q, uint16_t min);
+pool_rec_t * pool_put(pool_queue_t * q);
+void pool_drop(pool_queue_t * q);
+void pool_clear(pool_queue_t * q);
+uint16_t pool_free_get();
+uint16_t pool_free_min_get();
+uint16_t pool_avail_get(pool_queue_t * q);
+int8_t volatile pool_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
+
+
+
+
+#endif
@@ -5,6 +5,25 @@
  *
  * This module implements an API
  * to make real-time pulses generation using GPIO
+ *
+ * A period of the pulses is the pin hold time (HIGH) and the pin setup time (LOW).
+ * New times of the running task are used from the next period start,
+ * so the infinite PWM task is retuned without an abort.
+ *
+ * Channels in the PWM mode don't run tasks, they belong to a group
+ * with the shared PWM period. Pin changes of the group period are sorted
+ * by the time offset (the timeline), so every pass only walks the due edges
+ * and the due pin changes of all groups are written once per GPIO port.
+ * After a duty change the next timeline is built a few channels per pass
+ * and it's used from the next period start.
+ *
+ * Sigma-delta channels don't use groups, the duty is the modulator input
+ * and their pins go to the same port writes at every modulator step.
+ *
+ * A PWM channel on the pin with the PWM function (PA5, PL10) is driven
+ * by the H3 PWM controller with the group period, it takes no loop time.
+ * The controller uses a new duty from its next period, the phase
+ * and center alignment of the group aren't used.
  */
 
 #include "mod_timer.h"
@@ -14,14 +33,48 @@
 
 
 
+#define G group[g] // current group
+
+
+
+
 // private vars
 
 static uint8_t max_id = 0; // maximum channel id
 static struct pulsgen_ch_t gen[PULSGEN_CH_CNT] = {0}; // array of channels data
 static uint8_t msg_buf[PULSGEN_MSG_BUF_LEN] = {0};
 static uint64_t tick = 0, wd_ticks = 0, wd_todo_tick = 0;
-static struct pulsgen_fifo_item_t fifo[PULSGEN_CH_CNT][PULSGEN_FIFO_SIZE] = {{0}};
-static uint8_t fifo_pos[PULSGEN_CH_CNT] = {0};
+static pool_queue_t queue[PULSGEN_CH_CNT] = {{0}}; // channel tasks
+static struct pulsgen_group_t group[PULSGEN_GROUP_CNT] = {{0}}; // PWM groups
+
+// pin changes of the current pass
+static uint32_t port_set[GPIO_PORTS_CNT] = {0};
+static uint32_t port_clr[GPIO_PORTS_CNT] = {0};
+static uint8_t ports = 0; // mask of ports to write
+
+static uint32_t sd_mask = 0; // sigma-delta channels
+static uint32_t sd_ticks = 0; // modulator step period, 0 = every pass
+static uint64_t sd_tick = 0; // next modulator step
+
+// hardware PWM controllers
+static const struct pulsgen_hw_t hw[PULSGEN_HW_CNT] =
+{
+    {PA, 5, GPIO_FUNC_BANK_A_PWM0, PULSGEN_HW_BASE},
+    {PL, 10, GPIO_FUNC_BANK_L_S_PWM, PULSGEN_HW_R_BASE}
+};
+static uint8_t hw_ch[PULSGEN_HW_CNT] = {0}; // channel id + 1 of the controller, 0 = free
+static uint32_t hw_ctrl[PULSGEN_HW_CNT] = {0}; // register values to write
+static uint32_t hw_period[PULSGEN_HW_CNT] = {0};
+static uint8_t hw_todo = 0; // mask of controllers to write
+
+// prescaler codes and their dividers, the best resolution first
+#define PULSGEN_HW_PRESCALERS 11
+static const uint8_t hw_prescal[PULSGEN_HW_PRESCALERS] = {0xF, 0x0, 0x1, 0x2, 0x3, 0x4, 0x8, 0x9, 0xA, 0xB, 0xC};
+static const uint32_t hw_div[PULSGEN_HW_PRESCALERS] = {1, 120, 180, 240, 360, 480, 12000, 24000, 36000, 48000, 72000};
+
+// events to send
+static struct pulsgen_event_t events[PULSGEN_EVENTS_SIZE] = {{0}};
+static uint8_t events_head = 0, events_cnt = 0;
 
 // uses with GPIO module macros
 extern volatile uint32_t * gpio_port_data[GPIO_PORTS_CNT];
@@ -32,15 +85,329 @@ extern volatile uint32_t * gpio_port_data[GPIO_PORTS_CNT];
 // private function prototypes
 
 static void abort(uint8_t c);
-static void task_setup
-(
-    uint32_t c,
-    uint32_t toggles_dir,
-    uint32_t toggles,
-    uint32_t pin_setup_time,
-    uint32_t pin_hold_time,
-    uint32_t start_delay
-);
+static void event_put(uint8_t c, uint8_t type);
+static void events_send();
+static void task_setup(uint32_t c, pool_rec_t * task);
+
+// lower the maximum channel id to the highest busy channel
+static void max_id_update()
+{
+    while ( max_id && !gen[max_id].task ) --max_id;
+}
+
+static uint32_t ns_to_ticks(uint32_t ns)
+{
+    return (uint32_t) ( (uint64_t)ns * (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+}
+
+static void pin_put(uint8_t c, uint8_t state)
+{
+    gen[c].pin_state = state;
+
+    if ( (state ? gen[c].pin_mask : 0) ^ gen[c].pin_inverted )
+        GPIO_PIN_SET(gen[c].port, gen[c].pin_mask);
+    else
+        GPIO_PIN_CLEAR(gen[c].port, gen[c].pin_mask_not);
+}
+
+static void port_pin_put(uint8_t port, uint8_t pin, uint8_t state)
+{
+    if ( state )
+    {
+        port_set[port] |= 1U << pin;
+        port_clr[port] &= ~(1U << pin);
+    }
+    else
+    {
+        port_clr[port] |= 1U << pin;
+        port_set[port] &= ~(1U << pin);
+    }
+
+    ports |= 1U << port;
+}
+
+static void ports_update()
+{
+    static uint8_t p;
+
+    for ( p = GPIO_PORTS_CNT; p--; )
+    {
+        if ( !(ports & (1U << p)) ) continue;
+
+        GPIO_PORT_UPDATE(p, port_set[p], port_clr[p]);
+        port_set[p] = 0;
+        port_clr[p] = 0;
+    }
+
+    ports = 0;
+}
+
+// the latest period start of the group at time `t`
+static uint64_t period_start(uint8_t g, uint64_t t)
+{
+    return t - (t + G.period_ticks - G.phase_ticks) % G.period_ticks;
+}
+
+// the current timeline may drive the channel pins, build the next one
+static void group_rebuild(uint8_t g)
+{
+    G.build = 0;
+    G.ready = 0;
+    G.dirty = 1;
+}
+
+// remove the channel pin changes from the current timeline
+static void edges_drop(uint8_t g, uint8_t c)
+{
+    static struct pulsgen_timeline_t * tl;
+    static uint8_t i, n;
+
+    tl = &G.line[G.front];
+
+    for ( i = 0, n = 0; i < tl->cnt; i++ )
+    {
+        if ( tl->edge[i].port == gen[c].port && (tl->edge[i].pin & ~PULSGEN_EDGE_HIGH) == gen[c].pin )
+        {
+            if ( i < G.next ) G.next--;
+            continue;
+        }
+        tl->edge[n++] = tl->edge[i];
+    }
+
+    tl->cnt = n;
+}
+
+// insert the pin change to the timeline, it keeps the line sorted by the offset
+static void edge_add(struct pulsgen_timeline_t * tl, uint8_t g, uint32_t ticks, uint8_t c, uint8_t state)
+{
+    static uint8_t i;
+    static uint16_t offset;
+
+    if ( tl->cnt >= PULSGEN_EDGES_MAX ) return;
+
+    offset = (uint16_t) (ticks >> G.shift);
+
+    for ( i = tl->cnt++; i && tl->edge[i-1].offset > offset; i-- ) tl->edge[i] = tl->edge[i-1];
+
+    tl->edge[i].offset = offset;
+    tl->edge[i].port = (uint8_t) gen[c].port;
+    tl->edge[i].pin = gen[c].pin | ( (state ? 1 : 0) ^ (gen[c].pin_inverted ? 1 : 0) ? PULSGEN_EDGE_HIGH : 0 );
+}
+
+// add next PULSGEN_BUILD_CH channels of the group to the next timeline
+static void timeline_build(uint8_t g)
+{
+    static struct pulsgen_timeline_t * tl;
+    static uint8_t c, n;
+    static uint32_t on, rise;
+
+    tl = &G.line[G.front ^ 1];
+
+    for ( n = PULSGEN_BUILD_CH; n && G.build <= PULSGEN_CH_CNT; G.build++ )
+    {
+        c = G.build - 1;
+        if ( !(G.mask & (1UL << c)) || gen[c].hw ) continue;
+
+        n--;
+        on = (uint32_t) ( ((uint64_t)G.period_ticks * gen[c].duty) >> 16 );
+
+        // 0% or 100% duty? the same pin state for the whole period
+        if ( !on || on >= G.period_ticks )
+        {
+            edge_add(tl, g, 0, c, on ? 1 : 0);
+            continue;
+        }
+
+        rise = G.center ? (G.period_ticks - on) / 2 : 0;
+
+        // the pin state at the period start of the center-aligned pulse
+        if ( rise ) edge_add(tl, g, 0, c, 0);
+
+        edge_add(tl, g, rise, c, 1);
+        edge_add(tl, g, rise + on, c, 0);
+    }
+
+    // all channels are added? use the new timeline from the next period
+    if ( G.build > PULSGEN_CH_CNT )
+    {
+        G.build = 0;
+        G.ready = 1;
+    }
+}
+
+// put all due pin changes of the current period
+static void edges_apply(uint8_t g)
+{
+    static struct pulsgen_timeline_t * tl;
+    static struct pulsgen_edge_t * e;
+    static uint64_t t;
+
+    tl = &G.line[G.front];
+    t = (tick - G.start) >> G.shift;
+
+    for ( ; G.next < tl->cnt; G.next++ )
+    {
+        e = &tl->edge[G.next];
+        if ( t < e->offset ) break;
+        port_pin_put(e->port, e->pin & ~PULSGEN_EDGE_HIGH, e->pin & PULSGEN_EDGE_HIGH);
+    }
+}
+
+// next output bit of the sigma-delta modulator
+static uint8_t sd_step(uint8_t c)
+{
+    static int32_t fb;
+
+    if ( gen[c].mode == PULSGEN_MODE_SD1 )
+    {
+        gen[c].sd_i1 += (int32_t)gen[c].duty;
+        if ( gen[c].sd_i1 < PULSGEN_DUTY_MAX ) return 0;
+        gen[c].sd_i1 -= PULSGEN_DUTY_MAX;
+        return 1;
+    }
+
+    // 2nd order, the output is fed back to both integrators
+    fb = gen[c].sd_out ? PULSGEN_DUTY_MAX : 0;
+    gen[c].sd_i1 += (int32_t)gen[c].duty - fb;
+    gen[c].sd_i2 += gen[c].sd_i1 - fb;
+
+    // keep integrators bounded after the input steps
+    if ( gen[c].sd_i1 > 2*PULSGEN_DUTY_MAX ) gen[c].sd_i1 = 2*PULSGEN_DUTY_MAX;
+    else if ( gen[c].sd_i1 < -2*PULSGEN_DUTY_MAX ) gen[c].sd_i1 = -2*PULSGEN_DUTY_MAX;
+    if ( gen[c].sd_i2 > 4*PULSGEN_DUTY_MAX ) gen[c].sd_i2 = 4*PULSGEN_DUTY_MAX;
+    else if ( gen[c].sd_i2 < -4*PULSGEN_DUTY_MAX ) gen[c].sd_i2 = -4*PULSGEN_DUTY_MAX;
+
+    return gen[c].sd_i2 >= PULSGEN_DUTY_MAX/2 ? 1 : 0;
+}
+
+// one modulator step of all sigma-delta channels
+static void sd_update()
+{
+    static uint8_t c;
+
+    if ( sd_ticks )
+    {
+        if ( tick < sd_tick ) return;
+        sd_tick += sd_ticks;
+        if ( sd_tick <= tick ) sd_tick = tick + sd_ticks; // we are late
+    }
+
+    for ( c = PULSGEN_CH_CNT; c--; )
+    {
+        if ( !(sd_mask & (1UL << c)) ) continue;
+
+        gen[c].sd_out = sd_step(c);
+        port_pin_put(gen[c].port, gen[c].pin, gen[c].sd_out ^ (gen[c].pin_inverted ? 1 : 0));
+    }
+}
+
+// compute the controller registers of the channel
+static void hw_update(uint8_t c)
+{
+    static uint8_t u, g;
+    static uint32_t prescaler, period_reg;
+
+    u = gen[c].hw - 1;
+    g = gen[c].group;
+
+    if ( pulsgen_hw_calc(G.period, G.enabled ? gen[c].duty : 0, &prescaler, &period_reg) )
+    {
+        // the period is out of the controller range
+        hw_ctrl[u] = 0;
+        hw_period[u] = 0;
+    }
+    else
+    {
+        hw_ctrl[u] = prescaler | PULSGEN_HW_SCLK_GATING | PULSGEN_HW_EN | (gen[c].pin_inverted ? 0 : PULSGEN_HW_ACT_STA);
+        hw_period[u] = period_reg;
+    }
+
+    hw_todo |= 1U << u;
+}
+
+// write new values to the controllers
+static void hw_flush()
+{
+    static uint8_t u;
+
+    for ( u = PULSGEN_HW_CNT; u--; )
+    {
+        if ( !(hw_todo & (1U << u)) ) continue;
+
+        // the previous period value isn't taken yet?
+        if ( PULSGEN_HW_REG(hw[u].base, PULSGEN_HW_CTRL) & PULSGEN_HW_PERIOD_RDY ) continue;
+
+        PULSGEN_HW_REG(hw[u].base, PULSGEN_HW_CTRL) = hw_ctrl[u];
+        PULSGEN_HW_REG(hw[u].base, PULSGEN_HW_PERIOD) = hw_period[u];
+        hw_todo &= ~(1U << u);
+    }
+}
+
+// use the controller if the channel pin has the PWM function
+static void hw_attach(uint8_t c)
+{
+    static uint8_t u;
+
+    for ( u = PULSGEN_HW_CNT; u--; )
+    {
+        if ( hw[u].port != gen[c].port || hw[u].pin != gen[c].pin ) continue;
+        if ( hw_ch[u] ) return;
+
+        hw_ch[u] = c + 1;
+        gen[c].hw = u + 1;
+        gpio_pin_setup_for_func(hw[u].port, hw[u].pin, hw[u].func);
+        hw_update(c);
+        return;
+    }
+}
+
+static void hw_detach(uint8_t c)
+{
+    static uint8_t u;
+
+    if ( !gen[c].hw ) return;
+
+    u = gen[c].hw - 1;
+    hw_ch[u] = 0;
+    hw_todo &= ~(1U << u);
+    gen[c].hw = 0;
+
+    PULSGEN_HW_REG(hw[u].base, PULSGEN_HW_CTRL) = 0;
+    gpio_pin_setup_for_output(hw[u].port, hw[u].pin);
+    pin_put(c, 0);
+}
+
+static void group_update(uint8_t g)
+{
+    edges_apply(g);
+
+    // period is over?
+    if ( tick - G.start >= G.period_ticks )
+    {
+        G.start += G.period_ticks;
+        if ( tick - G.start >= G.period_ticks ) G.start = period_start(g, tick); // we are late
+
+        // use the new timeline
+        if ( G.ready )
+        {
+            G.front ^= 1;
+            G.ready = 0;
+        }
+
+        G.next = 0;
+        edges_apply(g);
+    }
+
+    // a bounded part of the next timeline build
+    if ( G.build ) timeline_build(g);
+    else if ( G.dirty && !G.ready )
+    {
+        G.dirty = 0;
+        G.build = 1;
+        G.line[G.front ^ 1].cnt = 0;
+        timeline_build(g);
+    }
+}
 
 
 
@@ -60,6 +427,15 @@ void pulsgen_module_init()
     // start sys timer
     TIMER_START();
 
+    for ( i = PULSGEN_GROUP_CNT; i--; )
+    {
+        group[i].period = PULSGEN_PERIOD;
+        group[i].period_ticks = ns_to_ticks(PULSGEN_PERIOD);
+    }
+
+    // one task record is always available for every channel
+    for ( i = PULSGEN_CH_CNT; i--; ) pool_queue_init(&queue[i], 1);
+
     // add message handlers
     for ( i = PULSGEN_MSG_PIN_SETUP; i < PULSGEN_MSG_CNT; i++ )
     {
@@ -74,13 +450,17 @@ void pulsgen_module_init()
  */
 void pulsgen_module_base_thread()
 {
-    static uint8_t c, abort_all = 0;
+    static uint8_t c, g, abort_all = 0;
 
     // get current CPU tick
     tick = timer_cnt_get_64();
 
     // have we a watchdog? && watchdog time is over?
-    if ( wd_todo_tick && tick > wd_todo_tick ) abort_all = 1; // set abort flag
+    if ( wd_todo_tick && tick > wd_todo_tick )
+    {
+        wd_todo_tick = 0; // disable watchdog
+        abort_all = 1; // set abort flag
+    }
 
     // check all working channels
     for ( c = max_id + 1; c--; )
@@ -94,39 +474,61 @@ void pulsgen_module_base_thread()
         // no steps to do?
         if ( !gen[c].task_toggles_todo && !gen[c].task_infinite )
         {
-            // goto new fifo item
-            fifo[c][fifo_pos[c]].used = 0;
-            if ( (++fifo_pos[c]) >= PULSGEN_FIFO_SIZE ) fifo_pos[c] = 0;
+            gen[c].tasks_done++;
+            event_put(c, PULSGEN_EVENT_TASK_DONE);
+
+            // goto next task in the queue
+            pool_drop(&queue[c]);
 
-            // have we a new task in the fifo?
-            if ( fifo[c][fifo_pos[c]].used ) // setup new task
+            // have we a new task in the queue?
+            if ( queue[c].head != POOL_NONE ) // setup new task
             {
-                task_setup(c,
-                    fifo[c][fifo_pos[c]].toggles_dir,
-                    fifo[c][fifo_pos[c]].toggles,
-                    fifo[c][fifo_pos[c]].pin_setup_time,
-                    fifo[c][fifo_pos[c]].pin_hold_time,
-                    fifo[c][fifo_pos[c]].start_delay);
+                task_setup(c, &pool[queue[c].head]);
             }
             else // disable channel
             {
                 gen[c].task = 0;
-                if ( max_id && c == max_id ) --max_id;
+                max_id_update();
+                event_put(c, PULSGEN_EVENT_QUEUE_EMPTY);
             }
 
             continue;
         }
 
         // pin state is HIGH?
-        if ( GPIO_PIN_GET(gen[c].port, gen[c].pin_mask) ^ gen[c].pin_inverted )
+        if ( gen[c].pin_state )
         {
-            GPIO_PIN_CLEAR(gen[c].port, gen[c].pin_mask_not);
+            // 100% duty of the infinite task? keep the pin HIGH till the period start
+            if ( gen[c].task_infinite && !gen[c].setup_ticks && !gen[c].abort_on_setup )
+            {
+                gen[c].pin_state = 0;
+                continue;
+            }
+
+            pin_put(c, 0);
             if ( gen[c].abort_on_setup ) abort(c);
             else gen[c].todo_tick += (uint64_t)gen[c].setup_ticks;
         }
-        else // pin state is LOW
+        else // pin state is LOW, it's a period start
         {
-            GPIO_PIN_SET(gen[c].port, gen[c].pin_mask);
+            // use the new times of the task
+            if ( gen[c].update )
+            {
+                gen[c].update = 0;
+                gen[c].setup_ticks = gen[c].new_setup_ticks;
+                gen[c].hold_ticks = gen[c].new_hold_ticks;
+            }
+
+            // 0% duty of the infinite task? keep the pin LOW for the whole period
+            if ( gen[c].task_infinite && !gen[c].hold_ticks )
+            {
+                pin_put(c, 0);
+                if ( gen[c].abort_on_hold ) abort(c);
+                else gen[c].todo_tick += (uint64_t)gen[c].setup_ticks;
+                continue;
+            }
+
+            pin_put(c, 1);
             if ( gen[c].abort_on_hold ) abort(c);
             else gen[c].todo_tick += (uint64_t)gen[c].hold_ticks;
         }
@@ -135,11 +537,26 @@ void pulsgen_module_base_thread()
         --gen[c].task_toggles_todo;
 
         // update total toggles value
-        gen[c].cnt += gen[c].task_toggles * (gen[c].toggles_dir ? -1 : 1);
+        if ( gen[c].toggles_dir ) --gen[c].cnt;
+        else ++gen[c].cnt;
+    }
+
+    // watchdog time is over? turn off the PWM channels
+    if ( abort_all )
+    {
+        for ( c = PULSGEN_CH_CNT; c--; ) if ( gen[c].mode != PULSGEN_MODE_TASK ) pulsgen_duty_set(c, 0);
+        abort_all = 0; // reset abort flag
     }
 
-    // watchdog time is over?
-    if ( abort_all ) abort_all = 0; // reset abort flag
+    // PWM groups
+    for ( g = PULSGEN_GROUP_CNT; g--; ) if ( G.enabled ) group_update(g);
+
+    if ( sd_mask ) sd_update();
+    if ( ports ) ports_update();
+    if ( hw_todo ) hw_flush();
+
+    // send events
+    if ( events_cnt ) events_send();
 }
 
 
@@ -157,16 +574,26 @@ void pulsgen_module_base_thread()
  */
 void pulsgen_pin_setup(uint8_t c, uint8_t port, uint8_t pin, uint8_t inverted)
 {
+    hw_detach(c);
+
+    // the current timeline mustn't drive the old pin
+    if ( gen[c].mode == PULSGEN_MODE_PWM ) edges_drop(gen[c].group, c);
+
     gpio_pin_setup_for_output(port, pin);
 
     gen[c].port = port;
     gen[c].pin_mask = 1U << pin;
     gen[c].pin_mask_not = ~(gen[c].pin_mask);
     gen[c].pin_inverted = inverted ? gen[c].pin_mask : 0;
+    gen[c].pin = pin;
 
     // set pin state
-    if ( gen[c].pin_inverted )  GPIO_PIN_SET    (port, gen[c].pin_mask);
-    else                        GPIO_PIN_CLEAR  (port, gen[c].pin_mask_not);
+    pin_put(c, 0);
+
+    if ( gen[c].mode != PULSGEN_MODE_PWM ) return;
+
+    group_rebuild(gen[c].group);
+    hw_attach(c);
 }
 
 
@@ -194,75 +621,111 @@ void pulsgen_task_add
     uint32_t start_delay
 )
 {
-    uint8_t i, pos;
+    pool_rec_t * task;
 
-    // channel is busy?
-    if ( gen[c].task )
-    {
-        // find free fifo slot for the new task
-        for ( i = PULSGEN_FIFO_SIZE, pos = fifo_pos[c] + 1; i--; pos++ )
-        {
-            if ( pos >= PULSGEN_FIFO_SIZE ) pos = 0;
-            if ( fifo[c][pos].used ) continue;
+    // channel makes no tasks?
+    if ( gen[c].mode != PULSGEN_MODE_TASK ) return;
 
-            fifo[c][pos].used = 1;
-            fifo[c][pos].toggles_dir = toggles_dir;
-            fifo[c][pos].toggles = toggles;
-            fifo[c][pos].pin_setup_time = pin_setup_time;
-            fifo[c][pos].pin_hold_time = pin_hold_time;
-            fifo[c][pos].start_delay = start_delay;
+    // channel queue is full? OR no free records in the pool?
+    if ( queue[c].cnt >= PULSGEN_FIFO_SIZE ) return;
+    if ( !(task = pool_put(&queue[c])) ) return;
 
-            return;
-        }
+    task->dir = toggles_dir ? 1 : 0;
+    task->pulses = toggles;
+    task->low_ticks = ns_to_ticks(pin_setup_time);
+    task->high_ticks = ns_to_ticks(pin_hold_time);
+    task->delay_ticks = ns_to_ticks(start_delay);
 
-        return;
-    }
-
-    // block current fifo item
-    fifo[c][fifo_pos[c]].used = 1;
+    // channel is busy?
+    if ( gen[c].task ) return;
 
     // setup current task
-    task_setup(c, toggles_dir, toggles, pin_setup_time, pin_hold_time, start_delay);
+    task_setup(c, task);
 }
 
-static void task_setup
-(
-    uint32_t c,
-    uint32_t toggles_dir,
-    uint32_t toggles,
-    uint32_t pin_setup_time,
-    uint32_t pin_hold_time,
-    uint32_t start_delay
-)
+static void task_setup(uint32_t c, pool_rec_t * task)
 {
-    if ( c > max_id ) ++max_id;
+    if ( c > max_id ) max_id = c;
 
     // set task data
     gen[c].task = 1;
-    gen[c].task_infinite = toggles ? 0 : 1;
-    gen[c].toggles_dir = toggles_dir;
-    gen[c].task_toggles = toggles ? toggles : UINT32_MAX;
+    gen[c].task_infinite = task->pulses ? 0 : 1;
+    gen[c].toggles_dir = task->dir;
+    gen[c].task_toggles = task->pulses ? task->pulses : UINT32_MAX;
     gen[c].task_toggles_todo = gen[c].task_toggles;
     gen[c].abort_on_hold = 0;
     gen[c].abort_on_setup = 0;
+    gen[c].update = 0;
 
-    gen[c].setup_ticks = (uint32_t) ( (uint64_t)pin_setup_time *
-        (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
-    gen[c].hold_ticks = (uint32_t) ( (uint64_t)pin_hold_time *
-        (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
-
-    gen[c].todo_tick = tick;
+    gen[c].setup_ticks = task->low_ticks;
+    gen[c].hold_ticks = task->high_ticks;
 
     // if we need a delay before task start
-    if ( start_delay )
+    gen[c].todo_tick = tick + (uint64_t)task->delay_ticks;
+}
+
+
+
+/**
+ * @brief   change pin times of the current task for the selected channel
+ *
+ * @param   c               channel id
+ * @param   pin_setup_time  new pin state setup_time (in nanoseconds)
+ * @param   pin_hold_time   new pin state hold_time (in nanoseconds)
+ *
+ * @note    new times are used from the next period start (pin goes HIGH),
+ *          the task and its toggles counter aren't changed
+ *
+ * @retval  none
+ */
+void pulsgen_task_update(uint8_t c, uint32_t pin_setup_time, uint32_t pin_hold_time)
+{
+    gen[c].new_setup_ticks = ns_to_ticks(pin_setup_time);
+    gen[c].new_hold_ticks = ns_to_ticks(pin_hold_time);
+    gen[c].update = 1;
+}
+
+/**
+ * @brief   set PWM period and duty cycle for the selected channel
+ *
+ * @param   c       channel id
+ * @param   period  PWM period (in nanoseconds), 0 = stop at the pulse end
+ * @param   duty    duty cycle, 0..PULSGEN_DUTY_MAX (0..100%)
+ *
+ * @note    an idle channel starts the infinite task,
+ *          a busy channel uses new values from the next period start.
+ *          Channels in the PWM mode use pulsgen_duty_set() instead.
+ *
+ * @retval  none
+ */
+void pulsgen_pwm_set(uint8_t c, uint32_t period, uint32_t duty)
+{
+    uint32_t period_ticks, hold_ticks;
+
+    if ( gen[c].mode != PULSGEN_MODE_TASK ) return;
+
+    if ( !period )
     {
-        gen[c].todo_tick += (uint64_t)start_delay *
-            (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000;
+        if ( gen[c].task ) pulsgen_abort(c, 0);
+        return;
     }
+
+    if ( duty > PULSGEN_DUTY_MAX ) duty = PULSGEN_DUTY_MAX;
+
+    period_ticks = ns_to_ticks(period);
+    hold_ticks = (uint32_t) ( ((uint64_t)period_ticks * duty) >> 16 );
+
+    // channel is idle? start the infinite task
+    if ( !gen[c].task && queue[c].head == POOL_NONE ) pulsgen_task_add(c, 0, 0, 0, 0, 0);
+
+    gen[c].new_setup_ticks = period_ticks - hold_ticks;
+    gen[c].new_hold_ticks = hold_ticks;
+    gen[c].update = 1;
 }
 
 
 
+
 /**
  * @brief   abort current task for the selected channel
  * @param   c           channel id
@@ -272,7 +735,7 @@ static void task_setup
 void pulsgen_abort(uint8_t c, uint8_t on_hold)
 {
     // pin state is HIGH?
-    if ( GPIO_PIN_GET(gen[c].port, gen[c].pin_mask) ^ gen[c].pin_inverted )
+    if ( gen[c].pin_state )
     {
         // abort on pin hold?
         if ( on_hold ) { abort(c); return; }
@@ -291,16 +754,294 @@ void pulsgen_abort(uint8_t c, uint8_t on_hold)
 
 static void abort(uint8_t c)
 {
-    uint8_t i;
-
     gen[c].abort_on_hold = 0;
     gen[c].abort_on_setup = 0;
     gen[c].task = 0;
 
-    if ( max_id && c == max_id ) --max_id;
+    max_id_update();
+
+    // queue cleanup
+    pool_clear(&queue[c]);
+
+    event_put(c, PULSGEN_EVENT_ABORT);
+}
+
+
+
+
+static void event_put(uint8_t c, uint8_t type)
+{
+    static struct pulsgen_event_t * e;
+
+    if ( !(gen[c].events & type) || events_cnt >= PULSGEN_EVENTS_SIZE ) return;
+
+    e = &events[(events_head + events_cnt++) % PULSGEN_EVENTS_SIZE];
+    e->c = c;
+    e->type = type;
+    e->cnt = gen[c].cnt;
+    e->tick = gen[c].todo_tick;
+}
+
+static void events_send()
+{
+    static struct pulsgen_event_t * e;
+    u32_10_t *out = (u32_10_t*) msg_buf;
 
-    // fifo cleanup
-    for ( i = PULSGEN_FIFO_SIZE; i--; ) fifo[c][i].used = 0;
+    for ( ; events_cnt; events_cnt-- )
+    {
+        e = &events[events_head];
+
+        out->v[0] = e->c | ((uint32_t)e->type << 8);
+        out->v[1] = (uint32_t) e->cnt;
+        out->v[2] = (uint32_t) e->tick;
+        out->v[3] = (uint32_t) (e->tick >> 32);
+
+        // no free message slots? try again at the next pass
+        if ( msg_send(PULSGEN_MSG_EVENT, msg_buf, 4*4) ) return;
+
+        if ( ++events_head >= PULSGEN_EVENTS_SIZE ) events_head = 0;
+    }
+}
+
+/**
+ * @brief   enable/disable events for the selected channel
+ *
+ * @param   c       channel id
+ * @param   mask    events to send: 1:task done, 2:queue empty, 4:abort
+ *
+ * @note    every event is sent as the PULSGEN_MSG_EVENT message with
+ *          channel id | event type << 8, toggles counter, event tick (low and high words).
+ *          Up to PULSGEN_EVENTS_SIZE events are waiting for the free message slots,
+ *          newer events are lost if the buffer is full.
+ *
+ * @retval  none
+ */
+void pulsgen_events_setup(uint8_t c, uint8_t mask)
+{
+    gen[c].events = mask;
+}
+
+
+
+
+/**
+ * @brief   setup the PWM channels group
+ *
+ * @param   g       group id
+ * @param   enable  0 = disable, other values - enable
+ * @param   period  PWM period (in nanoseconds)
+ * @param   phase   period start offset (in nanoseconds)
+ * @param   center  0 = pulses start at the period start, !0 = center-aligned pulses
+ *
+ * @note    period starts of all groups are aligned to the same time base,
+ *          so groups with the same period keep the `phase` difference.
+ *          The group restarts with this call,
+ *          disabled group sets its channel pins to the inactive state.
+ *
+ * @retval  none
+ */
+void pulsgen_group_setup(uint8_t g, uint8_t enable, uint32_t period, uint32_t phase, uint8_t center)
+{
+    uint8_t c;
+
+    G.enabled = 0;
+
+    if ( !enable )
+    {
+        for ( c = PULSGEN_CH_CNT; c--; )
+        {
+            if ( !(G.mask & (1UL << c)) ) continue;
+            if ( gen[c].hw ) hw_update(c);
+            else pin_put(c, 0);
+        }
+        return;
+    }
+
+    G.period = period ? period : PULSGEN_PERIOD;
+    G.period_ticks = ns_to_ticks(G.period);
+    if ( !G.period_ticks ) G.period_ticks = 1;
+    G.phase_ticks = ns_to_ticks(phase) % G.period_ticks;
+    G.center = center ? 1 : 0;
+
+    // edge offsets are 16-bit
+    for ( G.shift = 0; ((G.period_ticks - 1) >> G.shift) > UINT16_MAX; G.shift++ );
+
+    // the first timeline is built at once
+    G.ready = 0;
+    G.dirty = 0;
+    G.build = 1;
+    G.line[G.front ^ 1].cnt = 0;
+    while ( G.build ) timeline_build(g);
+    G.front ^= 1;
+    G.ready = 0;
+
+    G.start = period_start(g, timer_cnt_get_64());
+    G.next = 0;
+
+    G.enabled = 1;
+
+    for ( c = PULSGEN_CH_CNT; c--; ) if ( (G.mask & (1UL << c)) && gen[c].hw ) hw_update(c);
+}
+
+/**
+ * @brief   set the channel output mode
+ *
+ * @param   c       channel id
+ * @param   mode    PULSGEN_MODE_TASK, PULSGEN_MODE_PWM,
+ *                  PULSGEN_MODE_SD1 or PULSGEN_MODE_SD2
+ * @param   g       group id for the PULSGEN_MODE_PWM
+ *
+ * @note    the current task of the channel is aborted,
+ *          the channel starts with 0% duty cycle.
+ *          Sigma-delta channels output the duty as the pulse density,
+ *          the pin is updated at every modulator step (see pulsgen_sd_setup()).
+ *          Use an RC filter to get the analog value.
+ *          A PWM channel on the pin with the PWM function uses
+ *          the hardware controller if it's free.
+ *          A group has up to PULSGEN_GROUP_CH_MAX channels,
+ *          the mode isn't changed if the group is full.
+ *          Use pulsgen_pin_setup() before this call.
+ *
+ * @retval  none
+ */
+void pulsgen_mode_set(uint8_t c, uint8_t mode, uint8_t g)
+{
+    if ( mode >= PULSGEN_MODE_CNT || g >= PULSGEN_GROUP_CNT ) return;
+
+    // the group is full?
+    if ( mode == PULSGEN_MODE_PWM && !(G.mask & (1UL << c)) && G.cnt >= PULSGEN_GROUP_CH_MAX ) return;
+
+    if ( gen[c].task ) abort(c);
+
+    // leave the current group
+    if ( gen[c].mode == PULSGEN_MODE_PWM )
+    {
+        hw_detach(c);
+        edges_drop(gen[c].group, c);
+        group[gen[c].group].mask &= ~(1UL << c);
+        group[gen[c].group].cnt--;
+        group_rebuild(gen[c].group);
+    }
+
+    gen[c].mode = mode;
+    gen[c].duty = 0;
+    gen[c].sd_i1 = 0;
+    gen[c].sd_i2 = 0;
+    gen[c].sd_out = 0;
+    pin_put(c, 0);
+
+    if ( mode == PULSGEN_MODE_SD1 || mode == PULSGEN_MODE_SD2 ) sd_mask |= 1UL << c;
+    else sd_mask &= ~(1UL << c);
+
+    if ( mode != PULSGEN_MODE_PWM ) return;
+
+    gen[c].group = g;
+    G.mask |= 1UL << c;
+    G.cnt++;
+    group_rebuild(g);
+    hw_attach(c);
+}
+
+/**
+ * @brief   set the duty cycle of the channel in the PWM or sigma-delta mode
+ * @param   c       channel id
+ * @param   duty    0..PULSGEN_DUTY_MAX (0..100%)
+ * @note    new duty cycle is used from the next period start after the timeline build,
+ *          sigma-delta channels use it from the next modulator step
+ * @retval  none
+ */
+void pulsgen_duty_set(uint8_t c, uint32_t duty)
+{
+    if ( duty > PULSGEN_DUTY_MAX ) duty = PULSGEN_DUTY_MAX;
+    if ( duty == gen[c].duty ) return;
+
+    gen[c].duty = duty;
+
+    if ( gen[c].mode != PULSGEN_MODE_PWM ) return;
+
+    if ( gen[c].hw ) hw_update(c);
+    else group[gen[c].group].dirty = 1;
+}
+
+/**
+ * @brief   setup the sigma-delta modulator clock
+ * @param   period  modulator step period (in nanoseconds), 0 = every base thread pass
+ * @note    the fixed step period makes the output density independent
+ *          of the main loop speed, it must be longer than a loop pass
+ * @retval  none
+ */
+void pulsgen_sd_setup(uint32_t period)
+{
+    sd_ticks = ns_to_ticks(period);
+    sd_tick = timer_cnt_get_64();
+}
+
+/**
+ * @brief   get the duty cycle of the channel in the PWM or sigma-delta mode
+ * @param   c   channel id
+ * @retval  0..PULSGEN_DUTY_MAX
+ */
+uint32_t pulsgen_duty_get(uint8_t c)
+{
+    return gen[c].duty;
+}
+
+/**
+ * @brief   get the hardware controller of the channel
+ * @param   c   channel id
+ * @retval  0 (software output) or the controller id + 1
+ */
+uint8_t pulsgen_hw_get(uint8_t c)
+{
+    return gen[c].hw;
+}
+
+/**
+ * @brief   compute the hardware PWM controller registers
+ *
+ * @param   period      PWM period (in nanoseconds)
+ * @param   duty        0..PULSGEN_DUTY_MAX (0..100%)
+ * @param   prescaler   pointer to the PULSGEN_HW_CTRL prescaler code
+ * @param   period_reg  pointer to the PULSGEN_HW_PERIOD value
+ *
+ * @note    the smallest clock divider that fits the period is used
+ *          to get the best duty resolution
+ *
+ * @retval   0 (done)
+ * @retval  -1 (period is out of the controller range)
+ */
+int8_t pulsgen_hw_calc(uint32_t period, uint32_t duty, uint32_t * prescaler, uint32_t * period_reg)
+{
+    uint8_t i;
+    uint32_t cycles = 0, active;
+
+    for ( i = 0; i < PULSGEN_HW_PRESCALERS; i++ )
+    {
+        // period in the prescaled clock cycles, rounded
+        cycles = (uint32_t) ( ((uint64_t)period * (PULSGEN_HW_CLK / 1000000) + (uint64_t)hw_div[i] * 500) /
+            ((uint64_t)hw_div[i] * 1000) );
+        if ( cycles <= PULSGEN_HW_CYCLES_MAX ) break;
+    }
+
+    if ( i >= PULSGEN_HW_PRESCALERS || !cycles ) return -1;
+
+    if ( duty > PULSGEN_DUTY_MAX ) duty = PULSGEN_DUTY_MAX;
+    active = (uint32_t) ( ((uint64_t)cycles * duty + PULSGEN_DUTY_MAX / 2) >> 16 );
+
+    *prescaler = hw_prescal[i];
+    *period_reg = ((cycles - 1) << 16) | active;
+
+    return 0;
+}
+
+/**
+ * @brief   get the number of pin changes of the group period
+ * @param   g   group id
+ * @retval  0..PULSGEN_EDGES_MAX
+ */
+uint8_t pulsgen_edges_get(uint8_t g)
+{
+    return G.line[G.front].cnt;
 }
 
 
@@ -387,6 +1128,8 @@ void pulsgen_tasks_done_set(uint8_t c, uint32_t tasks)
  * @brief   enable/disable `abort all` watchdog
  * @param   enable      0 = disable watchdog, other values - enable watchdog
  * @param   time        watchdog wait time (in nanoseconds)
+ * @note    the expired watchdog aborts all tasks, sets 0% duty of the PWM channels
+ *          and disables itself, call this function again to re-arm it
  * @retval  none
  */
 void pulsgen_watchdog_setup(uint8_t enable, uint32_t time)
@@ -420,44 +1163,70 @@ int8_t volatile pulsgen_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
     // any incoming message will update the watchdog wait time
     if ( wd_todo_tick ) wd_todo_tick = tick + wd_ticks;
 
-    u32_10_t in = *((u32_10_t*) msg);
-    u32_10_t out = *((u32_10_t*) &msg_buf);
+    u32_10_t *in = (u32_10_t*) msg;
+    u32_10_t *out = (u32_10_t*) msg_buf;
 
     switch (type)
     {
         case PULSGEN_MSG_PIN_SETUP:
-            pulsgen_pin_setup(in.v[0], in.v[1], in.v[2], in.v[3]);
+            pulsgen_pin_setup(in->v[0], in->v[1], in->v[2], in->v[3]);
             break;
         case PULSGEN_MSG_TASK_ADD:
-            pulsgen_task_add(in.v[0], in.v[1], in.v[2], in.v[3], in.v[4], in.v[5]);
+            pulsgen_task_add(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4], in->v[5]);
             break;
         case PULSGEN_MSG_ABORT:
-            pulsgen_abort(in.v[0], in.v[1]);
+            pulsgen_abort(in->v[0], in->v[1]);
             break;
         case PULSGEN_MSG_STATE_GET:
-            out.v[0] = pulsgen_state_get(in.v[0]);
+            out->v[0] = pulsgen_state_get(in->v[0]);
             msg_send(type, msg_buf, 4);
             break;
         case PULSGEN_MSG_TASK_TOGGLES_GET:
-            out.v[0] = pulsgen_task_toggles_get(in.v[0]);
+            out->v[0] = pulsgen_task_toggles_get(in->v[0]);
             msg_send(type, msg_buf, 4);
             break;
         case PULSGEN_MSG_CNT_GET:
-            out.v[0] = pulsgen_cnt_get(in.v[0]);
+            out->v[0] = pulsgen_cnt_get(in->v[0]);
             msg_send(type, msg_buf, 4);
             break;
         case PULSGEN_MSG_CNT_SET:
-            pulsgen_cnt_set(in.v[0], (int32_t)in.v[1]);
+            pulsgen_cnt_set(in->v[0], (int32_t)in->v[1]);
             break;
         case PULSGEN_MSG_TASKS_DONE_GET:
-            out.v[0] = pulsgen_tasks_done_get(in.v[0]);
+            out->v[0] = pulsgen_tasks_done_get(in->v[0]);
             msg_send(type, msg_buf, 4);
             break;
         case PULSGEN_MSG_TASKS_DONE_SET:
-            pulsgen_tasks_done_set(in.v[0], in.v[1]);
+            pulsgen_tasks_done_set(in->v[0], in->v[1]);
             break;
         case PULSGEN_MSG_WATCHDOG_SETUP:
-            pulsgen_watchdog_setup(in.v[0], in.v[1]);
+            pulsgen_watchdog_setup(in->v[0], in->v[1]);
+            break;
+        case PULSGEN_MSG_EVENTS_SETUP:
+            pulsgen_events_setup(in->v[0], in->v[1]);
+            break;
+        case PULSGEN_MSG_TASK_UPDATE:
+            pulsgen_task_update(in->v[0], in->v[1], in->v[2]);
+            break;
+        case PULSGEN_MSG_PWM_SET:
+            pulsgen_pwm_set(in->v[0], in->v[1], in->v[2]);
+            break;
+        case PULSGEN_MSG_GROUP_SETUP:
+            pulsgen_group_setup(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4]);
+            break;
+        case PULSGEN_MSG_MODE_SET:
+            pulsgen_mode_set(in->v[0], in->v[1], in->v[2]);
+            break;
+        case PULSGEN_MSG_DUTY_SET: // up to 5 pairs of channel id and duty
+            for ( i = 0; i + 1 < length / 4 && i + 1 < 10; i += 2 ) pulsgen_duty_set(in->v[i], in->v[i+1]);
+            break;
+        case PULSGEN_MSG_GROUP_STATE_GET:
+            out->v[0] = group[in->v[0]].enabled;
+            out->v[1] = pulsgen_edges_get(in->v[0]);
+            msg_send(type, msg_buf, 2*4);
+            break;
+        case PULSGEN_MSG_SD_SETUP:
+            pulsgen_sd_setup(in->v[0]);
             break;
 
         default: return -1;
@@ -561,4 +1330,142 @@ int8_t volatile pulsgen_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
             return 0;
         }
     @endcode
+
+    <b>Usage example 3</b>: spindle PWM retuned on the fly
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_pulsgen.h"
+
+        int main(void)
+        {
+            uint32_t n = 0;
+
+            // module init
+            pulsgen_module_init();
+
+            // use GPIO pin PA6 for the channel 2 output
+            pulsgen_pin_setup(2, PA, 6, 0);
+
+            // start 1 kHz PWM with 25% duty cycle
+            pulsgen_pwm_set(2, 1000000, PULSGEN_DUTY_MAX / 4);
+
+            // main loop
+            for(;;)
+            {
+                // 75% duty cycle from the next period, the task isn't aborted
+                if ( ++n == 100000 ) pulsgen_pwm_set(2, 1000000, PULSGEN_DUTY_MAX / 4 * 3);
+
+                pulsgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
+
+    <b>Usage example 4</b>: 24 heater outputs at 1 kHz, two center-aligned groups
+    with the half period shift to spread the supply current
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_pulsgen.h"
+
+        int main(void)
+        {
+            uint8_t c;
+
+            // module init
+            pulsgen_module_init();
+
+            // outputs PA0..PA11 (group 0) and PD0..PD11 (group 1)
+            for ( c = 0; c < 12; c++ )
+            {
+                pulsgen_pin_setup(c, PA, c, 0);
+                pulsgen_pin_setup(12 + c, PD, c, 0);
+                pulsgen_mode_set(c, PULSGEN_MODE_PWM, 0);
+                pulsgen_mode_set(12 + c, PULSGEN_MODE_PWM, 1);
+                pulsgen_duty_set(c, PULSGEN_DUTY_MAX / 24 * c);
+                pulsgen_duty_set(12 + c, PULSGEN_DUTY_MAX / 24 * (12 + c));
+            }
+
+            // 1 ms period, the 2nd group starts 500 us later
+            pulsgen_group_setup(0, 1, 1000000, 0, 1);
+            pulsgen_group_setup(1, 1, 1000000, 500000, 1);
+
+            // main loop
+            for(;;)
+            {
+                pulsgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
+
+    <b>Usage example 5</b>: VFD speed input and laser power by RC-filtered
+    2nd order sigma-delta outputs, 1 MHz modulator clock
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_pulsgen.h"
+
+        int main(void)
+        {
+            // module init
+            pulsgen_module_init();
+
+            // outputs PA6 and PA7
+            pulsgen_pin_setup(0, PA, 6, 0);
+            pulsgen_pin_setup(1, PA, 7, 0);
+            pulsgen_mode_set(0, PULSGEN_MODE_SD2, 0);
+            pulsgen_mode_set(1, PULSGEN_MODE_SD2, 0);
+            pulsgen_sd_setup(1000);
+
+            // 37.5% and 0.1% of the full scale
+            pulsgen_duty_set(0, PULSGEN_DUTY_MAX / 8 * 3);
+            pulsgen_duty_set(1, PULSGEN_DUTY_MAX / 1000);
+
+            // main loop
+            for(;;)
+            {
+                pulsgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
+
+    <b>Usage example 6</b>: spindle PWM on PA5, made by the hardware controller
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_pulsgen.h"
+
+        int main(void)
+        {
+            // module init
+            pulsgen_module_init();
+
+            // PA5 has the PWM function, so the channel uses the controller
+            pulsgen_pin_setup(0, PA, 5, 0);
+            pulsgen_mode_set(0, PULSGEN_MODE_PWM, 0);
+
+            // 10 kHz, 40% duty cycle
+            pulsgen_group_setup(0, 1, 100000, 0, 0);
+            pulsgen_duty_set(0, PULSGEN_DUTY_MAX / 10 * 4);
+
+            // main loop
+            for(;;)
+            {
+                // writes the controller registers when they aren't busy
+                pulsgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
 */
@@ -5,6 +5,10 @@
  *
  * This module implements an API
  * to make real-time pulses generation using GPIO
+ * (free PWM outputs for spindles, heaters, etc.)
+ * and many PWM outputs by the edge timelines of the channel groups
+ * or by the sigma-delta modulators.
+ * Pins with the PWM function use the H3 PWM controllers
  */
 
 #ifndef _MOD_PULSGEN_H
@@ -13,12 +17,44 @@
 #include <stdint.h>
 #include "mod_msg.h"
 #include "mod_timer.h"
+#include "mod_pool.h"
 
 
 
 
 #define PULSGEN_CH_CNT      32  ///< maximum number of pulse generator channels
-#define PULSGEN_FIFO_SIZE   4   ///< size of channel's fifo buffer
+#define PULSGEN_FIFO_SIZE   4   ///< max size of channel's tasks queue
+#define PULSGEN_DUTY_MAX    65536 ///< 100% duty cycle for the pulsgen_pwm_set() and pulsgen_duty_set()
+#define PULSGEN_EVENTS_SIZE 8   ///< size of the events buffer
+
+#define PULSGEN_GROUP_CNT   2   ///< maximum number of PWM channel groups
+#define PULSGEN_EDGES_MAX   48  ///< max pin changes of the group period
+#define PULSGEN_GROUP_CH_MAX (PULSGEN_EDGES_MAX / 3) ///< max channels of the group
+#define PULSGEN_BUILD_CH    4   ///< channels added to the new group timeline per pass
+#define PULSGEN_PERIOD      50000 ///< default group PWM period (in nanoseconds)
+#define PULSGEN_EDGE_HIGH   0x80 ///< pin state bit of the timeline edge
+
+#define PULSGEN_HW_CNT          2           ///< number of hardware PWM controllers
+#define PULSGEN_HW_BASE         0x01C21400  ///< PWM0 (PA5) registers block start address
+#define PULSGEN_HW_R_BASE       0x01F03800  ///< S_PWM (PL10) registers block start address
+#define PULSGEN_HW_CLK          24000000    ///< controller clock (OSC24M), Hz
+#define PULSGEN_HW_CYCLES_MAX   0xFFFF      ///< max period cycles
+
+// controller registers
+#define PULSGEN_HW_CTRL         0x00
+#define PULSGEN_HW_PERIOD       0x04
+
+// PULSGEN_HW_CTRL bits
+#define PULSGEN_HW_PRESCAL_MASK 0xF
+#define PULSGEN_HW_EN           (1U << 4)
+#define PULSGEN_HW_ACT_STA      (1U << 5) // active state is HIGH
+#define PULSGEN_HW_SCLK_GATING  (1U << 6)
+#define PULSGEN_HW_PERIOD_RDY   (1U << 28) // period register is busy
+
+/// register access, host-side tests may define it before this header
+#ifndef PULSGEN_HW_REG
+#define PULSGEN_HW_REG(BASE,OFFSET) (*((volatile uint32_t *)((BASE) + (OFFSET))))
+#endif
 
 
 
@@ -30,6 +66,9 @@ struct pulsgen_ch_t
     uint32_t    pin_mask;           // GPIO pin mask
     uint32_t    pin_mask_not;       // GPIO pin ~mask
     uint32_t    pin_inverted;       // same as `pin_mask` or 0
+    uint8_t     pin;                // GPIO pin number
+
+    uint8_t     pin_state;          // 0 = LOW, 1 = HIGH (without inversion)
 
     uint8_t     task;               // 0 = "channel disabled"
     uint8_t     task_infinite;      // 0 = "make task_toggles and disable the channel"
@@ -43,28 +82,88 @@ struct pulsgen_ch_t
     uint32_t    setup_ticks;        // number of CPU ticks to prepare pin toggle
     uint32_t    hold_ticks;         // number of CPU ticks to hold pin state
 
+    uint8_t     update;             // new ticks must be used at the period start
+    uint32_t    new_setup_ticks;
+    uint32_t    new_hold_ticks;
+
     uint8_t     abort_on_setup;
     uint8_t     abort_on_hold;
 
     uint64_t    todo_tick;          // timestamp (in CPU ticks) to change pin state
+
+    uint8_t     events;             // mask of events to send
+
+    uint8_t     mode;               // PULSGEN_MODE_x
+    uint8_t     group;              // PWM group id
+    uint32_t    duty;               // 0..PULSGEN_DUTY_MAX of the group PWM or sigma-delta
+    int32_t     sd_i1;              // sigma-delta integrators
+    int32_t     sd_i2;
+    uint8_t     sd_out;             // last sigma-delta output bit
+    uint8_t     hw;                 // hardware PWM controller id + 1, 0 = software output
+};
+
+/// an event waiting for the free message slot
+struct pulsgen_event_t
+{
+    uint8_t     c;                  // channel id
+    uint8_t     type;
+    int32_t     cnt;                // total number of pin toggles
+    uint64_t    tick;
 };
 
-struct pulsgen_fifo_item_t
+/// hardware PWM controller and its pin
+struct pulsgen_hw_t
 {
-    uint8_t used;
-    uint8_t toggles_dir;
-    uint32_t toggles;
-    uint32_t pin_setup_time;
-    uint32_t pin_hold_time;
-    uint32_t start_delay;
+    uint8_t     port;
+    uint8_t     pin;
+    uint8_t     func;               // pin function
+    uint32_t    base;               // registers block address
 };
 
+/// pin change at the time offset from the group period start
+struct pulsgen_edge_t
+{
+    uint16_t    offset;             // in group ticks (CPU ticks >> group shift)
+    uint8_t     port;               // GPIO port number
+    uint8_t     pin;                // GPIO pin number | PULSGEN_EDGE_HIGH
+};
+
+/// pin changes of the group period sorted by the offset
+struct pulsgen_timeline_t
+{
+    uint8_t     cnt;
+    struct pulsgen_edge_t edge[PULSGEN_EDGES_MAX];
+};
+
+/// channels with the same PWM period
+struct pulsgen_group_t
+{
+    uint8_t     enabled;
+    uint8_t     center;             // center-aligned pulses?
+    uint8_t     shift;              // group ticks = CPU ticks >> shift
+    uint8_t     cnt;                // number of channels
+    uint32_t    mask;               // channels of the group
+    uint32_t    period;             // in nanoseconds
+    uint32_t    period_ticks;
+    uint32_t    phase_ticks;        // period start offset from the time base
+
+    struct pulsgen_timeline_t line[2]; // current and next timelines
+    uint8_t     front;              // current timeline
+    uint8_t     next;               // next edge of the current timeline
+    uint8_t     build;              // next channel id + 1 to add to the next timeline, 0 = no build
+    uint8_t     ready;              // next timeline is built, use it from the next period
+    uint8_t     dirty;              // next timeline must be built again
+
+    uint64_t    start;              // current period start
+};
+
+
 
 
 /// messages types
 enum
 {
-    PULSGEN_MSG_PIN_SETUP = 0x20,
+    PULSGEN_MSG_PIN_SETUP = 0x90,
     PULSGEN_MSG_TASK_ADD,
     PULSGEN_MSG_ABORT,
     PULSGEN_MSG_STATE_GET,
@@ -74,9 +173,36 @@ enum
     PULSGEN_MSG_TASKS_DONE_GET,
     PULSGEN_MSG_TASKS_DONE_SET,
     PULSGEN_MSG_WATCHDOG_SETUP,
+    PULSGEN_MSG_EVENTS_SETUP,
+    PULSGEN_MSG_TASK_UPDATE,
+    PULSGEN_MSG_PWM_SET,
+    PULSGEN_MSG_EVENT, // ARISC -> ARM only
+    PULSGEN_MSG_GROUP_SETUP,
+    PULSGEN_MSG_MODE_SET,
+    PULSGEN_MSG_DUTY_SET,
+    PULSGEN_MSG_GROUP_STATE_GET,
+    PULSGEN_MSG_SD_SETUP,
     PULSGEN_MSG_CNT
 };
 
+/// channel output modes
+enum
+{
+    PULSGEN_MODE_TASK, // pin toggle tasks
+    PULSGEN_MODE_PWM, // PWM by the group timeline
+    PULSGEN_MODE_SD1, // 1st order sigma-delta
+    PULSGEN_MODE_SD2, // 2nd order sigma-delta
+    PULSGEN_MODE_CNT
+};
+
+/// event types (bit mask)
+enum
+{
+    PULSGEN_EVENT_TASK_DONE = 1,
+    PULSGEN_EVENT_QUEUE_EMPTY = 2,
+    PULSGEN_EVENT_ABORT = 4
+};
+
 /// the message data sizes
 #define PULSGEN_MSG_BUF_LEN MSG_LEN
 
@@ -89,6 +215,8 @@ void pulsgen_module_init();
 void pulsgen_module_base_thread();
 void pulsgen_pin_setup(uint8_t c, uint8_t port, uint8_t pin, uint8_t inverted);
 void pulsgen_task_add(uint32_t c, uint32_t toggles_dir, uint32_t toggles, uint32_t pin_setup_time, uint32_t pin_hold_time, uint32_t start_delay);
+void pulsgen_task_update(uint8_t c, uint32_t pin_setup_time, uint32_t pin_hold_time);
+void pulsgen_pwm_set(uint8_t c, uint32_t period, uint32_t duty);
 void pulsgen_abort(uint8_t c, uint8_t on_hold);
 uint8_t pulsgen_state_get(uint8_t c);
 uint32_t pulsgen_task_toggles_get(uint8_t c);
@@ -98,6 +226,15 @@ uint32_t pulsgen_tasks_done_get(uint8_t c);
 void pulsgen_tasks_done_set(uint8_t c, uint32_t tasks);
 int8_t volatile pulsgen_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
 void pulsgen_watchdog_setup(uint8_t enable, uint32_t time);
+void pulsgen_events_setup(uint8_t c, uint8_t mask);
+void pulsgen_group_setup(uint8_t g, uint8_t enable, uint32_t period, uint32_t phase, uint8_t center);
+void pulsgen_mode_set(uint8_t c, uint8_t mode, uint8_t g);
+void pulsgen_duty_set(uint8_t c, uint32_t duty);
+uint32_t pulsgen_duty_get(uint8_t c);
+uint8_t pulsgen_edges_get(uint8_t g);
+void pulsgen_sd_setup(uint32_t period);
+uint8_t pulsgen_hw_get(uint8_t c);
+int8_t pulsgen_hw_calc(uint32_t period, uint32_t duty, uint32_t * prescaler, uint32_t * period_reg);
 
 
 
@@ -0,0 +1,381 @@
+/**
+ * @file    mod_raster.c
+ * @brief   raster laser module
+ * This module implements an API to change the laser power
+ * at every pixel of the scanline while the stepgen channel moves
+ *
+ * The ARM fills the back line buffer while the front one is burned.
+ * The pixel is taken from the stepgen channel position, so the power
+ * is latched every `steps` steps in both scan directions.
+ * The beam is a pulsgen PWM channel: 8-bit pixels set its duty,
+ * 1-bit pixels turn the beam on/off.
+ */
+
+#include "mod_stepgen.h"
+#include "mod_pulsgen.h"
+#include "mod_raster.h"
+
+
+
+
+#define FRONT line[front]       // line to burn
+#define BACK line[front ^ 1]    // line to fill
+
+
+
+
+// private vars
+
+static raster_line_t line[2] = {{0}}; // double-buffered lines
+static uint8_t front = 0;
+static uint8_t msg_buf[RASTER_MSG_BUF_LEN] = {0}; // message buffer
+
+static uint8_t enabled = 0, ch = 0;
+static uint8_t laser = 0; // pulsgen channel of the beam
+
+static int32_t last_pos = 0;
+static uint8_t update = 0; // the pixel must be taken again
+static uint32_t lines_done = 0;
+static uint8_t done_todo = 0; // line done message to send
+
+
+
+
+// private functions
+
+// power of the pixel, 0..255
+static uint8_t pixel_get(uint32_t px)
+{
+    if ( FRONT.bpp == 8 ) return FRONT.data[px];
+
+    return FRONT.data[px >> 3] & (0x80 >> (px & 7)) ? 255 : 0;
+}
+
+// take the pixel at the current position
+static void pixel_update(int32_t pos)
+{
+    static int32_t d;
+    static uint32_t px;
+
+    d = (pos - FRONT.start) * FRONT.dir;
+
+    // before the 1st pixel?
+    if ( d < 0 ) { pulsgen_duty_set(laser, 0); return; }
+
+    px = (uint32_t)d / FRONT.steps;
+
+    // after the last pixel?
+    if ( px >= FRONT.pixels )
+    {
+        pulsgen_duty_set(laser, 0);
+        FRONT.state = RASTER_LINE_FREE;
+        lines_done++;
+        done_todo = 1;
+        return;
+    }
+
+    pulsgen_duty_set(laser, pixel_get(px) * PULSGEN_DUTY_MAX / 255);
+}
+
+static void line_done_send()
+{
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    out->v[0] = lines_done;
+    out->v[1] = BACK.state;
+
+    if ( !msg_send(RASTER_MSG_LINE_DONE, msg_buf, 2*4) ) done_todo = 0;
+}
+
+
+
+
+// public methods
+
+/**
+ * @brief   module init
+ * @note    call this function only once before raster_module_base_thread()
+ * @retval  none
+ */
+void raster_module_init()
+{
+    uint8_t i = 0;
+
+    // add message handlers
+    for ( i = RASTER_MSG_SETUP; i < RASTER_MSG_CNT; i++ )
+    {
+        msg_recv_callback_add(i, (msg_recv_func_t) raster_msg_recv);
+    }
+}
+
+/**
+ * @brief   module base thread
+ * @note    call this function in the main loop, after stepgen_module_base_thread()
+ *          and before pulsgen_module_base_thread()
+ * @retval  none
+ */
+void raster_module_base_thread()
+{
+    static int32_t pos;
+
+    if ( !enabled ) return;
+
+    // current line is over and the next one is ready?
+    if ( FRONT.state != RASTER_LINE_ACTIVE && BACK.state == RASTER_LINE_READY )
+    {
+        front ^= 1;
+        FRONT.state = RASTER_LINE_ACTIVE;
+        update = 1;
+    }
+
+    // new position? take a new pixel
+    if ( FRONT.state == RASTER_LINE_ACTIVE )
+    {
+        pos = stepgen_pos_get(ch);
+        if ( update || pos != last_pos ) pixel_update(pos);
+        last_pos = pos;
+        update = 0;
+    }
+
+    if ( done_todo ) line_done_send();
+}
+
+
+
+
+/**
+ * @brief   setup the laser output
+ *
+ * @param   enable      0 = disable, other values - enable
+ * @param   c           stepgen channel id of the scan axis
+ * @param   pwm         pulsgen channel id of the laser
+ *
+ * @note    the laser channel must be set up by pulsgen_pin_setup()
+ *          and pulsgen_mode_set() in the PWM mode, its group sets
+ *          the PWM period (the PA5 and PL10 pins use the hardware PWM)
+ *
+ * @retval  none
+ */
+void raster_setup(uint8_t enable, uint8_t c, uint8_t pwm)
+{
+    if ( pwm >= PULSGEN_CH_CNT ) return;
+
+    raster_abort();
+
+    ch = c;
+    laser = pwm;
+
+    enabled = enable ? 1 : 0;
+}
+
+/**
+ * @brief   start filling of the next line
+ *
+ * @param   start   stepgen position of the 1st pixel start
+ * @param   dir     scan direction, 1 = position goes up, -1 = position goes down
+ * @param   steps   steps per pixel
+ * @param   pixels  number of pixels
+ * @param   bpp     bits per pixel, 1 or 8
+ *
+ * @note    1-bit pixels are packed MSB first
+ *
+ * @retval   0 (line buffer is ready for the data)
+ * @retval  -1 (back line buffer isn't free or wrong parameters)
+ */
+int8_t raster_line_setup(int32_t start, int8_t dir, uint32_t steps, uint16_t pixels, uint8_t bpp)
+{
+    if ( BACK.state != RASTER_LINE_FREE && BACK.state != RASTER_LINE_FILL ) return -1;
+    if ( !steps || !pixels || (bpp != 1 && bpp != 8) ) return -1;
+    if ( (bpp == 8 ? pixels : (pixels + 7) / 8) > RASTER_LINE_SIZE ) return -1;
+
+    BACK.state = RASTER_LINE_FILL;
+    BACK.start = start;
+    BACK.dir = dir < 0 ? -1 : 1;
+    BACK.steps = steps;
+    BACK.pixels = pixels;
+    BACK.bpp = bpp;
+
+    return 0;
+}
+
+/**
+ * @brief   put the pixels data to the line being filled
+ *
+ * @param   offset  data offset (in bytes)
+ * @param   data    pointer to the data
+ * @param   len     data size (in bytes)
+ *
+ * @retval   0 (data saved)
+ * @retval  -1 (no line to fill or wrong offset)
+ */
+int8_t raster_line_data(uint16_t offset, uint8_t * data, uint8_t len)
+{
+    uint8_t i;
+
+    if ( BACK.state != RASTER_LINE_FILL ) return -1;
+    if ( (uint32_t)offset + len > RASTER_LINE_SIZE ) return -1;
+
+    for ( i = 0; i < len; i++ ) BACK.data[offset + i] = data[i];
+
+    return 0;
+}
+
+/**
+ * @brief   mark the filled line as ready to burn
+ * @note    the line starts right after the current one
+ * @retval   0 (line is ready)
+ * @retval  -1 (no line to commit)
+ */
+int8_t raster_line_commit()
+{
+    if ( BACK.state != RASTER_LINE_FILL ) return -1;
+
+    BACK.state = RASTER_LINE_READY;
+
+    return 0;
+}
+
+/**
+ * @brief   turn the beam off and drop all lines
+ * @retval  none
+ */
+void raster_abort()
+{
+    line[0].state = RASTER_LINE_FREE;
+    line[1].state = RASTER_LINE_FREE;
+    done_todo = 0;
+    if ( enabled ) pulsgen_duty_set(laser, 0);
+}
+
+
+
+
+/**
+ * @brief   get the state of the line being burned
+ * @retval  RASTER_LINE_FREE (no line to burn) or RASTER_LINE_ACTIVE
+ */
+uint8_t raster_state_get()
+{
+    return FRONT.state;
+}
+
+/**
+ * @brief   get number of the burned lines
+ * @retval  unsigned 32-bit number
+ */
+uint32_t raster_lines_done_get()
+{
+    return lines_done;
+}
+
+
+
+
+/**
+ * @brief   "message received" callback
+ *
+ * @note    this function will be called automatically
+ *          when a new message will arrive for this module.
+ *
+ * @param   type    user defined message type (0..0xFF)
+ * @param   msg     pointer to the message buffer
+ * @param   length  the length of a message (0 .. MSG_LEN)
+ *
+ * @retval   0 (message read)
+ * @retval  -1 (message not read)
+ */
+int8_t volatile raster_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
+{
+    u32_10_t *in = (u32_10_t*) msg;
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    switch (type)
+    {
+        case RASTER_MSG_SETUP:
+            raster_setup(in->v[0], in->v[1], in->v[2]);
+            break;
+        case RASTER_MSG_LINE_SETUP:
+            out->v[0] = raster_line_setup((int32_t)in->v[0], (int32_t)in->v[1], in->v[2], in->v[3], in->v[4]);
+            msg_send(type, msg_buf, 4);
+            break;
+        case RASTER_MSG_LINE_DATA: // offset, length, up to RASTER_DATA_LEN bytes
+            raster_line_data(in->v[0],
+                (uint8_t*) &in->v[2], in->v[1] > RASTER_DATA_LEN ? RASTER_DATA_LEN : in->v[1]);
+            break;
+        case RASTER_MSG_LINE_COMMIT:
+            out->v[0] = raster_line_commit();
+            msg_send(type, msg_buf, 4);
+            break;
+        case RASTER_MSG_ABORT:
+            raster_abort();
+            break;
+        case RASTER_MSG_STATE_GET:
+            out->v[0] = raster_state_get();
+            out->v[1] = BACK.state;
+            out->v[2] = raster_lines_done_get();
+            msg_send(type, msg_buf, 3*4);
+            break;
+
+        default: return -1;
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+    @example mod_raster.c
+
+    <b>Usage example 1</b>: one 8-bit scanline of 200 pixels, 10 steps per pixel
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_stepgen.h"
+        #include "mod_pulsgen.h"
+        #include "mod_raster.h"
+
+        int main(void)
+        {
+            uint8_t data[RASTER_DATA_LEN];
+            uint16_t i;
+
+            // modules init
+            stepgen_module_init();
+            pulsgen_module_init();
+            raster_module_init();
+
+            // X axis STEP/DIR pins
+            stepgen_pin_setup(0, 0, PA, 3, 0);
+            stepgen_pin_setup(0, 1, PA, 5, 0);
+
+            // laser pin, 20 kHz PWM of the group 0
+            pulsgen_pin_setup(0, PA, 10, 0);
+            pulsgen_mode_set(0, PULSGEN_MODE_PWM, 0);
+            pulsgen_group_setup(0, 1, 50000, 0, 0);
+            raster_setup(1, 0, 0);
+
+            // the line starts 100 steps ahead
+            raster_line_setup(100, 1, 10, 200, 8);
+            for ( i = 0; i < RASTER_DATA_LEN; i++ ) data[i] = i * 8;
+            for ( i = 0; i < 200; i += RASTER_DATA_LEN )
+                raster_line_data(i, data, 200 - i < RASTER_DATA_LEN ? 200 - i : RASTER_DATA_LEN);
+            raster_line_commit();
+
+            // sweep at 10 kHz
+            stepgen_task_add(0, 3, 2200, 50000, 50000);
+
+            // main loop
+            for(;;)
+            {
+                stepgen_module_base_thread();
+                raster_module_base_thread();
+                pulsgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
+*/
@@ -0,0 +1,75 @@
+/**
+ * @file    mod_raster.h
+ * @brief   raster laser module header
+ * This module implements an API to change the laser power
+ * at every pixel of the scanline while the stepgen channel moves
+ */
+
+#ifndef _MOD_RASTER_H
+#define _MOD_RASTER_H
+
+#include <stdint.h>
+#include "mod_msg.h"
+#include "mod_timer.h"
+
+
+
+
+#define RASTER_LINE_SIZE    512     ///< max size of the line data (in bytes)
+#define RASTER_DATA_LEN     32      ///< max line data bytes in one message
+#define RASTER_MSG_BUF_LEN  MSG_LEN
+
+enum
+{
+    RASTER_MSG_SETUP = 0x80,
+    RASTER_MSG_LINE_SETUP,
+    RASTER_MSG_LINE_DATA,
+    RASTER_MSG_LINE_COMMIT,
+    RASTER_MSG_ABORT,
+    RASTER_MSG_STATE_GET,
+    RASTER_MSG_LINE_DONE, // ARISC -> ARM only
+    RASTER_MSG_CNT
+};
+
+/// line buffer states
+enum
+{
+    RASTER_LINE_FREE,
+    RASTER_LINE_FILL, // ARM sends the data
+    RASTER_LINE_READY, // waits for the current line end
+    RASTER_LINE_ACTIVE
+};
+
+
+
+
+typedef struct
+{
+    uint8_t     state;
+    uint8_t     bpp; // bits per pixel, 1 or 8
+    int8_t      dir; // 1 = pixels go with the position up, -1 = down
+    int32_t     start; // stepgen position of the 1st pixel
+    uint32_t    steps; // steps per pixel
+    uint16_t    pixels;
+    uint8_t     data[RASTER_LINE_SIZE];
+
+} raster_line_t;
+
+
+
+
+void raster_module_init();
+void raster_module_base_thread();
+void raster_setup(uint8_t enable, uint8_t c, uint8_t pwm);
+int8_t raster_line_setup(int32_t start, int8_t dir, uint32_t steps, uint16_t pixels, uint8_t bpp);
+int8_t raster_line_data(uint16_t offset, uint8_t * data, uint8_t len);
+int8_t raster_line_commit();
+void raster_abort();
+uint8_t raster_state_get();
+uint32_t raster_lines_done_get();
+int8_t volatile raster_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
+
+
+
+
+#endif
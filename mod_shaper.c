@@ -0,0 +1,421 @@
+/**
+ * @file    mod_shaper.c
+ * @brief   input shaper module
+ * This module implements an API to make the stepgen channel moves
+ * with the input shaping (ZV, ZVD, EI, 2-hump EI) to reduce the ringing
+ *
+ * The commanded moves are kept as a piecewise linear position x(t).
+ * Every output slice the shaped position sum(A[i] * x(t - T[i])) is taken,
+ * it's the same as the convolution of the step rate with the impulses.
+ * The steps between two shaped positions are sent to the stepgen channel
+ * as one slice (stepgen_slice_add()). All maths is fixed point (Q16).
+ */
+
+#include "mod_stepgen.h"
+#include "mod_shaper.h"
+
+
+
+
+#define SH shp[s] // current channel
+#define SEG(n) SH.seg[(SH.seg_head + (n)) % SHAPER_SEG_CNT] // n-th move from the oldest
+
+#define Q16_PI      205887  // pi, Q16
+#define Q16_LN2     45426   // ln(2), Q16
+#define Q16_EI_A1   17203   // (1 + 0.05) / 4, 5% vibration tolerance
+#define Q16_EI_A2   31130   // (1 - 0.05) / 2
+#define Q16_2HEI_A1 10472   // 2-hump EI 1st impulse, 5% vibration tolerance
+
+
+
+
+// private vars
+
+static shaper_ch_t shp[SHAPER_CH_CNT] = {{0}}; // array of channels data
+static uint8_t msg_buf[SHAPER_MSG_BUF_LEN] = {0}; // message buffer
+
+
+
+
+// private functions
+
+static uint32_t isqrt64(uint64_t x)
+{
+    uint64_t r = 0, b = (uint64_t)1 << 62;
+
+    while ( b > x ) b >>= 2;
+
+    for ( ; b; b >>= 2 )
+    {
+        if ( x >= r + b ) { x -= r + b; r = (r >> 1) + b; }
+        else r >>= 1;
+    }
+
+    return (uint32_t) r;
+}
+
+static uint32_t ns_to_ticks(uint32_t ns)
+{
+    return (uint32_t) ( (uint64_t)ns * (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+}
+
+// exp(-x), x >= 0, Q16
+static uint32_t exp_neg(uint32_t x)
+{
+    uint32_t n = x / Q16_LN2, r = x % Q16_LN2, term = 65536, sum = 65536, k;
+
+    if ( n >= 16 ) return 0;
+
+    // exp(-r) for r < ln(2), Taylor series
+    for ( k = 1; k <= 8; k++ )
+    {
+        term = (uint32_t)( (uint64_t)term * r / 65536 / k );
+        sum = k & 1 ? sum - term : sum + term;
+    }
+
+    return sum >> n;
+}
+
+static uint32_t q16_mul(uint32_t a, uint32_t b)
+{
+    return (uint32_t)( ((uint64_t)a * b + 32768) >> 16 );
+}
+
+// commanded position at the time `t - delay` relative to the `ref`, Q16
+static int64_t cmd_pos(uint8_t s, uint64_t t, uint32_t delay, int32_t ref)
+{
+    static int8_t n;
+    static uint64_t f;
+
+    // find the newest move started before `t - delay`
+    for ( n = SH.seg_cnt; n--; )
+    {
+        if ( t < SEG(n).start + delay ) continue;
+
+        // move is over?
+        if ( t >= SEG(n).start + delay + SEG(n).ticks )
+            return (int64_t)(SEG(n).pos + SEG(n).steps - ref) * 65536;
+
+        // part of the move, Q16
+        f = ((t - delay - SEG(n).start) << 16) / SEG(n).ticks;
+
+        return (int64_t)(SEG(n).pos - ref) * 65536 + SEG(n).steps * (int64_t)f;
+    }
+
+    // before all moves
+    return (int64_t)((SH.seg_cnt ? SEG(0).pos : SH.pos) - ref) * 65536;
+}
+
+// impulses of the shaper type
+static void impulses_setup(uint8_t s, uint32_t freq, uint32_t damping)
+{
+    uint32_t a[SHAPER_IMPULSES_MAX], z, d, k, td, sum = 0, i;
+
+    // damped period and the amplitude ratio of the half periods
+    z = damping < 999 ? damping : 999;
+    d = isqrt64( (uint64_t)(1000000 - z*z) << 32 ) / 1000; // sqrt(1 - z^2), Q16
+    k = exp_neg( (uint32_t)( ((uint64_t)z * 65536 / 1000) * Q16_PI / d ) );
+    td = freq ? (uint32_t)( (uint64_t)TIMER_FREQUENCY * 1000 * 65536 / ((uint64_t)freq * d) ) : 0;
+
+    switch ( SH.type )
+    {
+        case SHAPER_ZV:
+            SH.cnt = 2;
+            a[0] = 65536; a[1] = k;
+            break;
+        case SHAPER_ZVD:
+            SH.cnt = 3;
+            a[0] = 65536; a[1] = 2*k; a[2] = q16_mul(k, k);
+            break;
+        case SHAPER_EI:
+            SH.cnt = 3;
+            a[0] = Q16_EI_A1; a[1] = q16_mul(Q16_EI_A2, k); a[2] = q16_mul(Q16_EI_A1, q16_mul(k, k));
+            break;
+        case SHAPER_2HUMP_EI:
+            SH.cnt = 4;
+            a[0] = Q16_2HEI_A1;
+            a[1] = q16_mul(32768 - Q16_2HEI_A1, k);
+            a[2] = q16_mul(a[1], k);
+            a[3] = q16_mul(Q16_2HEI_A1, q16_mul(k, q16_mul(k, k)));
+            break;
+        default:
+            SH.cnt = 1;
+            a[0] = 65536;
+    }
+
+    if ( !td ) SH.cnt = 1;
+
+    // impulses every half of the damped period, the sum of amplitudes is 1.0
+    for ( i = 0; i < SH.cnt; i++ ) sum += a[i];
+    for ( i = 0; i < SH.cnt; i++ )
+    {
+        SH.amp[i] = (uint32_t)( ((uint64_t)a[i] * 65536 + sum / 2) / sum );
+        SH.delay[i] = i * (td / 2);
+    }
+
+    // no rounding errors in the sum
+    SH.amp[0] = 65536;
+    for ( i = 1; i < SH.cnt; i++ ) SH.amp[0] -= SH.amp[i];
+}
+
+// send the next slice of the shaped position
+static void slice_send(uint8_t s)
+{
+    static uint64_t t;
+    static int64_t x;
+    static int32_t n;
+    static uint8_t i;
+
+    t = SH.out_tick + SH.slice_ticks;
+
+    for ( x = 0, i = 0; i < SH.cnt; i++ )
+    {
+        x += (cmd_pos(s, t, SH.delay[i], SH.out_pos) * SH.amp[i]) >> 16;
+    }
+
+    n = (int32_t)( (x + 32768) >> 16 );
+
+    if ( stepgen_slice_add(SH.ch, n, SH.slice_ticks) ) return;
+
+    SH.out_pos += n;
+    SH.out_tick = t;
+
+    // drop the moves which can't be used by the impulses anymore
+    while ( SH.seg_cnt > 1 &&
+            SEG(0).start + SEG(0).ticks + SH.delay[SH.cnt - 1] <= SH.out_tick )
+    {
+        SH.seg_head = (SH.seg_head + 1) % SHAPER_SEG_CNT;
+        SH.seg_cnt--;
+    }
+}
+
+
+
+
+// public methods
+
+/**
+ * @brief   module init
+ * @note    call this function only once before shaper_module_base_thread()
+ * @retval  none
+ */
+void shaper_module_init()
+{
+    uint8_t i = 0;
+
+    // add message handlers
+    for ( i = SHAPER_MSG_SETUP; i < SHAPER_MSG_CNT; i++ )
+    {
+        msg_recv_callback_add(i, (msg_recv_func_t) shaper_msg_recv);
+    }
+}
+
+/**
+ * @brief   module base thread
+ * @note    call this function in the main loop, before stepgen_module_base_thread()
+ * @retval  none
+ */
+void shaper_module_base_thread()
+{
+    static uint8_t s;
+    static uint64_t tick;
+
+    tick = timer_cnt_get_64();
+
+    for ( s = SHAPER_CH_CNT; s--; )
+    {
+        if ( !SH.enabled || !SH.seg_cnt ) continue;
+
+        // all moves and their echoes are done?
+        if ( SH.out_tick >= SH.end + SH.delay[SH.cnt - 1] )
+        {
+            SH.seg_cnt = 0;
+            continue;
+        }
+
+        // time to send the next slice?
+        if ( tick + SHAPER_SLICES_AHEAD * SH.slice_ticks >= SH.out_tick ) slice_send(s);
+    }
+}
+
+
+
+
+/**
+ * @brief   setup the input shaper of the stepgen channel
+ *
+ * @param   s           shaper channel id
+ * @param   enable      0 = disable, other values - enable
+ * @param   c           stepgen channel id
+ * @param   type        SHAPER_NONE, SHAPER_ZV, SHAPER_ZVD, SHAPER_EI or SHAPER_2HUMP_EI
+ * @param   freq        resonance frequency (in mHz)
+ * @param   damping     damping ratio (in 1/1000)
+ * @param   slice_time  output slice duration (in nanoseconds), 0 = default
+ *
+ * @note    the shaper is changed only when there are no moves in progress
+ *
+ * @retval  none
+ */
+void shaper_setup(uint8_t s, uint8_t enable, uint8_t c, uint8_t type,
+    uint32_t freq, uint32_t damping, uint32_t slice_time)
+{
+    if ( SH.enabled && SH.seg_cnt ) return;
+
+    SH.enabled = 0;
+    SH.ch = c;
+    SH.type = type < SHAPER_TYPE_CNT ? type : SHAPER_NONE;
+    SH.slice_ticks = ns_to_ticks(slice_time ? slice_time : SHAPER_SLICE_TIME);
+    impulses_setup(s, freq, damping);
+
+    SH.seg_cnt = 0;
+    SH.pos = stepgen_pos_get(c);
+    SH.out_pos = SH.pos;
+    SH.enabled = enable ? 1 : 0;
+}
+
+/**
+ * @brief   add a move to the shaped channel
+ *
+ * @param   s       shaper channel id
+ * @param   steps   number of steps, the sign is a direction
+ * @param   time    move duration (in nanoseconds)
+ *
+ * @note    moves must be added before their time comes,
+ *          a late move starts from the next slice after a stop
+ *
+ * @retval   0 (move added)
+ * @retval  -1 (no free slots or zero duration)
+ */
+int8_t shaper_move_add(uint8_t s, int32_t steps, uint32_t time)
+{
+    static shaper_seg_t * seg;
+
+    if ( !SH.enabled || SH.seg_cnt >= SHAPER_SEG_CNT || !ns_to_ticks(time) ) return -1;
+
+    // idle channel? start a bit later to have some slices ahead
+    if ( !SH.seg_cnt )
+    {
+        SH.out_tick = timer_cnt_get_64() + SHAPER_SLICES_AHEAD * SH.slice_ticks;
+        SH.end = SH.out_tick;
+    }
+
+    // late move during the impulses tail? start it from the next slice
+    if ( SH.end < SH.out_tick ) SH.end = SH.out_tick;
+
+    seg = &SEG(SH.seg_cnt);
+    seg->steps = steps;
+    seg->ticks = ns_to_ticks(time);
+    seg->start = SH.end;
+    seg->pos = SH.pos;
+
+    SH.pos += steps;
+    SH.end += seg->ticks;
+    SH.seg_cnt++;
+
+    return 0;
+}
+
+/**
+ * @brief   get number of free move slots of the shaped channel
+ * @param   s   shaper channel id
+ * @retval  0..SHAPER_SEG_CNT
+ */
+uint8_t shaper_free_get(uint8_t s)
+{
+    return SHAPER_SEG_CNT - SH.seg_cnt;
+}
+
+/**
+ * @brief   get the shaped channel state
+ * @param   s   shaper channel id
+ * @retval  0 (channel is idle)
+ * @retval  1 (channel is busy)
+ */
+uint8_t shaper_state_get(uint8_t s)
+{
+    return SH.seg_cnt ? 1 : 0;
+}
+
+
+
+
+/**
+ * @brief   "message received" callback
+ *
+ * @note    this function will be called automatically
+ *          when a new message will arrive for this module.
+ *
+ * @param   type    user defined message type (0..0xFF)
+ * @param   msg     pointer to the message buffer
+ * @param   length  the length of a message (0 .. MSG_LEN)
+ *
+ * @retval   0 (message read)
+ * @retval  -1 (message not read)
+ */
+int8_t volatile shaper_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
+{
+    u32_10_t *in = (u32_10_t*) msg;
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    switch (type)
+    {
+        case SHAPER_MSG_SETUP:
+            shaper_setup(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4], in->v[5], in->v[6]);
+            break;
+        case SHAPER_MSG_MOVE_ADD:
+            shaper_move_add(in->v[0], (int32_t)in->v[1], in->v[2]);
+            break;
+        case SHAPER_MSG_STATE_GET:
+            out->v[0] = shaper_state_get(in->v[0]);
+            out->v[1] = shaper_free_get(in->v[0]);
+            msg_send(type, msg_buf, 2*4);
+            break;
+
+        default: return -1;
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+    @example mod_shaper.c
+
+    <b>Usage example 1</b>: 40 Hz resonance, 10% damping, ZVD shaper
+
+    @code
+        #include <stdint.h>
+        #include "mod_gpio.h"
+        #include "mod_stepgen.h"
+        #include "mod_shaper.h"
+
+        int main(void)
+        {
+            // modules init
+            stepgen_module_init();
+            shaper_module_init();
+
+            // STEP/DIR pins
+            stepgen_pin_setup(0, 0, PA, 3, 0);
+            stepgen_pin_setup(0, 1, PA, 5, 0);
+
+            // default output slices
+            shaper_setup(0, 1, 0, SHAPER_ZVD, 40000, 100, 0);
+
+            // 2000 steps in 100 ms, 1000 steps back in 50 ms
+            shaper_move_add(0, 2000, 100000000);
+            shaper_move_add(0, -1000, 50000000);
+
+            // main loop
+            for(;;)
+            {
+                shaper_module_base_thread();
+                stepgen_module_base_thread();
+            }
+
+            return 0;
+        }
+    @endcode
+*/
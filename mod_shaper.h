@@ -0,0 +1,94 @@
+/**
+ * @file    mod_shaper.h
+ * @brief   input shaper module header
+ * This module implements an API to make the stepgen channel moves
+ * with the input shaping (ZV, ZVD, EI, 2-hump EI) to reduce the ringing
+ */
+
+#ifndef _MOD_SHAPER_H
+#define _MOD_SHAPER_H
+
+#include <stdint.h>
+#include "mod_msg.h"
+#include "mod_timer.h"
+
+
+
+
+#define SHAPER_CH_CNT           4       ///< maximum number of shaped channels
+#define SHAPER_IMPULSES_MAX     4       ///< maximum number of the shaper impulses
+#define SHAPER_SEG_CNT          16      ///< size of the channel moves queue
+#define SHAPER_SLICES_AHEAD     2       ///< slices sent to the stepgen before their time
+#define SHAPER_SLICE_TIME       250000  ///< default output slice duration (in nanoseconds)
+#define SHAPER_MSG_BUF_LEN      MSG_LEN
+
+enum
+{
+    SHAPER_MSG_SETUP = 0x88,
+    SHAPER_MSG_MOVE_ADD,
+    SHAPER_MSG_STATE_GET,
+    SHAPER_MSG_CNT
+};
+
+/// shaper types
+enum
+{
+    SHAPER_NONE,
+    SHAPER_ZV,
+    SHAPER_ZVD,
+    SHAPER_EI,
+    SHAPER_2HUMP_EI,
+    SHAPER_TYPE_CNT
+};
+
+
+
+
+/// a commanded move
+typedef struct
+{
+    int32_t     steps;
+    uint32_t    ticks; // duration
+    uint64_t    start; // start time
+    int32_t     pos; // commanded position at the start
+
+} shaper_seg_t;
+
+typedef struct
+{
+    uint8_t     enabled;
+    uint8_t     ch; // stepgen channel id
+    uint8_t     type;
+
+    uint8_t     cnt; // number of impulses
+    uint32_t    amp[SHAPER_IMPULSES_MAX]; // impulse amplitudes, Q16, the sum is 1.0
+    uint32_t    delay[SHAPER_IMPULSES_MAX]; // impulse delays (in ticks)
+    uint32_t    slice_ticks; // output slice duration
+
+    shaper_seg_t seg[SHAPER_SEG_CNT]; // commanded moves
+    uint8_t     seg_head; // the oldest move
+    uint8_t     seg_cnt;
+
+    int32_t     pos; // commanded position at the end of the last move
+    uint64_t    end; // end time of the last move
+    uint64_t    out_tick; // start time of the next output slice
+    int32_t     out_pos; // steps sent to the stepgen channel
+
+} shaper_ch_t;
+
+
+
+
+void shaper_module_init();
+void shaper_module_base_thread();
+void shaper_setup(uint8_t s, uint8_t enable, uint8_t c, uint8_t type,
+    uint32_t freq, uint32_t damping, uint32_t slice_time);
+int8_t shaper_move_add(uint8_t s, int32_t steps, uint32_t time);
+uint8_t shaper_free_get(uint8_t s);
+uint8_t shaper_state_get(uint8_t s);
+int8_t volatile shaper_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
+
+
+
+
+#endif
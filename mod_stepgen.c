@@ -12,18 +12,69 @@
 
 
 #define SG gen[c]               // current channel
-#define SLOT SG.task_slot       // current task slot
-#define TASK SG.tasks[SLOT]     // current task
+#define TASK pool[SG.queue.head] // current task, empty record if idle
 
 
 
 
 // private vars
 
-static uint8_t max_id = 0; // uses to speedup idle channels processing
 static stepgen_ch_t gen[STEPGEN_CH_CNT] = {0}; // array of channels data
 static uint8_t msg_buf[STEPGEN_MSG_BUF_LEN] = {0}; // message buffer
 static uint64_t tick = 0, wd_ticks = 0, wd_todo_tick = 0;
+static uint8_t wd_expired = 0;
+static uint32_t loop_ticks = 0; // max duration of the base thread
+
+// hot channel state used by the scheduler (struct of arrays)
+static uint64_t task_tick[STEPGEN_CH_CNT] = {0}; // time of the next channel update
+static uint32_t task_pulses[STEPGEN_CH_CNT] = {0}; // 0:idle, UINT32_MAX:infinite
+static uint32_t task_low[STEPGEN_CH_CNT] = {0}; // current task pin LOW time (in ticks)
+static uint32_t task_high[STEPGEN_CH_CNT] = {0}; // current task pin HIGH time (in ticks)
+static uint8_t task_type[STEPGEN_CH_CNT] = {0}; // current task type
+static uint8_t pin_state[STEPGEN_CH_CNT][2] = {{0}}; // 0:step, 1:dir
+static uint8_t task_dir_todo[STEPGEN_CH_CNT] = {0}; // 2:hold, 1:setup, 0:steps
+static uint8_t task_abort[STEPGEN_CH_CNT] = {0}; // 1:current task, 2:tasks added before the abort
+static uint8_t ramp[STEPGEN_CH_CNT] = {0}; // deceleration before the abort
+static int32_t step_pos[STEPGEN_CH_CNT] = {0}; // in pulses
+
+// output pins used on every edge
+static uint8_t pin_port[STEPGEN_CH_CNT][2] = {{0}};
+static uint32_t pin_mask[STEPGEN_CH_CNT][2] = {{0}};
+static uint8_t pin_invert[STEPGEN_CH_CNT][2] = {{0}};
+#if USE_STEPGEN_EXT
+static uint8_t quad[STEPGEN_CH_CNT] = {0}; // A/B output instead of STEP/DIR
+static uint32_t quad_ticks[STEPGEN_CH_CNT] = {0}; // min time between A/B edges
+
+// mirrored pins, mirror_mask = 0 if the pin isn't used
+static uint8_t mirror_cnt[STEPGEN_CH_CNT] = {0}; // number of used mirrored pin pairs
+static uint8_t mirror_port[STEPGEN_CH_CNT][STEPGEN_MIRROR_CNT][2] = {{{0}}};
+static uint32_t mirror_mask[STEPGEN_CH_CNT][STEPGEN_MIRROR_CNT][2] = {{{0}}};
+static uint8_t mirror_invert[STEPGEN_CH_CNT][STEPGEN_MIRROR_CNT][2] = {{{0}}};
+#endif
+
+// NCO step period = nco_period + nco_frac/2^32 ticks, nco_period = 0 for other tasks
+static uint32_t nco_period[STEPGEN_CH_CNT] = {0};
+static uint32_t nco_frac[STEPGEN_CH_CNT] = {0};
+static uint32_t nco_phase[STEPGEN_CH_CNT] = {0}; // fractional ticks accumulator
+
+// busy channels ordered by the task_tick (min-heap)
+static uint8_t heap[STEPGEN_CH_CNT] = {0};
+static uint8_t heap_size = 0;
+static uint8_t due[STEPGEN_CH_CNT] = {0}; // channels to update in this pass
+
+// channels with the low-water message to send
+static uint32_t low_water = 0;
+
+#if USE_STEPGEN_EXT
+// events to send
+static stepgen_event_t events[STEPGEN_EVENTS_SIZE] = {{0}};
+static uint8_t events_head = 0, events_cnt = 0;
+#endif
+
+// pin changes collected during the base thread pass
+static uint8_t ports = 0; // mask of touched ports
+static uint32_t port_set[GPIO_PORTS_CNT] = {0};
+static uint32_t port_clr[GPIO_PORTS_CNT] = {0};
 
 // uses with GPIO module macros
 extern volatile uint32_t * gpio_port_data[GPIO_PORTS_CNT];
@@ -31,304 +82,1383 @@ extern volatile uint32_t * gpio_port_data[GPIO_PORTS_CNT];
 
 
 
+// private function prototypes
+
+static void abort(uint8_t c);
+static void low_water_send();
+static void event_put(uint8_t c, uint8_t type);
+static uint8_t ramp_down(uint8_t c);
+static void nco_step(uint8_t c);
+static int8_t slice_put(uint8_t c, int32_t steps, uint32_t ticks);
+
+
+
+
 // private functions
 
-static void busy(uint8_t c)
+static void heap_push(uint8_t c)
+{
+    static uint8_t i, p;
+
+    // move parents down until the right place for the channel is found
+    for ( i = heap_size++; i; i = p )
+    {
+        p = (i - 1) / 2;
+        if ( task_tick[heap[p]] <= task_tick[c] ) break;
+        heap[i] = heap[p];
+    }
+
+    heap[i] = c;
+}
+
+static uint8_t heap_pop()
+{
+    static uint8_t i, k, c, top;
+
+    top = heap[0];
+    c = heap[--heap_size];
+
+    // move the last channel from the top down to the right place
+    for ( i = 0; (k = 2*i + 1) < heap_size; i = k )
+    {
+        if ( k + 1 < heap_size && task_tick[heap[k+1]] < task_tick[heap[k]] ) k++;
+        if ( task_tick[c] <= task_tick[heap[k]] ) break;
+        heap[i] = heap[k];
+    }
+
+    heap[i] = c;
+
+    return top;
+}
+
+static void port_pin_put(uint8_t port, uint32_t mask, uint8_t state)
+{
+    if ( state )
+    {
+        port_set[port] |= mask;
+        port_clr[port] &= ~mask;
+    }
+    else
+    {
+        port_clr[port] |= mask;
+        port_set[port] &= ~mask;
+    }
+
+    ports |= 1U << port;
+}
+
+static void pin_put(uint8_t c, uint8_t t, uint8_t state)
+{
+#if USE_STEPGEN_EXT
+    static uint8_t m;
+#endif
+
+    port_pin_put(pin_port[c][t], pin_mask[c][t], state ^ pin_invert[c][t]);
+
+#if USE_STEPGEN_EXT
+    // mirrored pins are changed in the same port update
+    for ( m = mirror_cnt[c]; m--; )
+    {
+        if ( !mirror_mask[c][m][t] ) continue;
+        port_pin_put(mirror_port[c][m][t], mirror_mask[c][m][t], state ^ mirror_invert[c][m][t]);
+    }
+#endif
+}
+
+static void update_pin(uint8_t c, uint8_t t)
+{
+    pin_put(c, t, pin_state[c][t]);
+}
+
+#if USE_STEPGEN_EXT
+// quadrature state of the position (gray code): A = STEP pin, B = DIR pin
+static void quad_put(uint8_t c)
+{
+    pin_put(c, STEPGEN_TASK_STEP, ((step_pos[c] >> 1) ^ step_pos[c]) & 1);
+    pin_put(c, STEPGEN_TASK_DIR, (step_pos[c] >> 1) & 1);
+}
+
+// time between the quadrature edges
+static uint32_t quad_period(uint8_t c)
+{
+    return task_low[c] + task_high[c] > quad_ticks[c] ? task_low[c] + task_high[c] : quad_ticks[c];
+}
+#endif
+
+static void update_ports()
+{
+    static uint8_t p;
+
+    // write each touched port only once
+    for ( p = GPIO_PORTS_CNT; p--; )
+    {
+        if ( !(ports & (1U << p)) ) continue;
+
+        GPIO_PORT_UPDATE(p, port_set[p], port_clr[p]);
+        port_set[p] = 0;
+        port_clr[p] = 0;
+    }
+
+    ports = 0;
+}
+
+static void task_start(uint8_t c)
+{
+    // copy the task to the hot state
+    task_type[c] = TASK.type == STEPGEN_TASK_NCO ? STEPGEN_TASK_STEP : TASK.type;
+    task_pulses[c] = TASK.pulses > INT32_MAX ? UINT32_MAX : TASK.pulses;
+    task_low[c] = TASK.low_ticks;
+    task_high[c] = TASK.high_ticks;
+    nco_period[c] = TASK.type == STEPGEN_TASK_NCO ? TASK.low_ticks : 0;
+    nco_frac[c] = TASK.delay_ticks;
+
+    if ( task_type[c] ) // DIR or WAIT task
+    {
+        task_tick[c] += task_low[c];
+    }
+#if USE_STEPGEN_EXT
+    else if ( quad[c] ) // STEP task, quadrature output
+    {
+        // no DIR pin, so no DIR timings
+        task_dir_todo[c] = 0;
+        if ( TASK.dir ) pin_state[c][STEPGEN_TASK_DIR] = TASK.dir - 1;
+        if ( nco_period[c] ) nco_step(c);
+        task_tick[c] += quad_period(c);
+    }
+#endif
+    else // STEP task
+    {
+        task_dir_todo[c] = 0;
+
+        // DIR change before the 1st step?
+        if ( TASK.dir && (TASK.dir - 1) != pin_state[c][STEPGEN_TASK_DIR] )
+        {
+            task_dir_todo[c] = 2;
+            task_tick[c] += SG.dir_hold_ticks;
+            return;
+        }
+
+        pin_state[c][STEPGEN_TASK_STEP] = 1;
+        task_tick[c] += task_high[c];
+        update_pin(c, STEPGEN_TASK_STEP);
+    }
+}
+
+static int8_t fifo_put(uint8_t c, uint8_t type, uint32_t pulses, uint32_t low_ticks, uint32_t high_ticks)
+{
+    uint8_t dir = 0;
+    pool_rec_t * rec;
+
+    // MOVE task is a STEP task with own direction
+    if ( type == STEPGEN_TASK_MOVE )
+    {
+        // no steps or INT32_MIN, which has no positive counterpart
+        if ( !pulses || pulses == 0x80000000 ) return -1;
+
+        if ( (int32_t)pulses < 0 ) { dir = 2; pulses = 0u - pulses; }
+        else dir = 1;
+        type = STEPGEN_TASK_STEP;
+    }
+
+    // no steps to do?
+    if ( !pulses && (type == STEPGEN_TASK_STEP || type == STEPGEN_TASK_NCO) ) return -1;
+
+    // channel queue is full?
+    if ( SG.queue.cnt >= SG.queue_size ) return -1;
+
+    // no free records in the pool?
+    if ( !(rec = pool_put(&SG.queue)) ) return -1;
+
+    rec->type = type;
+    rec->pulses = type == STEPGEN_TASK_DIR ? 2 : (type == STEPGEN_TASK_WAIT ? 1 : pulses);
+    rec->dir = dir;
+    rec->low_ticks = low_ticks;
+    rec->high_ticks = high_ticks;
+
+    // queue is above the low-water mark again?
+    if ( SG.queue.cnt >= SG.stream_low_water ) SG.stream_low = 0;
+
+    return 0;
+}
+
+static int8_t slice_put(uint8_t c, int32_t steps, uint32_t ticks)
+{
+    uint8_t dir = steps < 0 ? 1 : 0;
+    uint32_t n = steps < 0 ? -steps : steps, period;
+
+    // channel is idle? start from the current DIR state
+    if ( !task_pulses[c] )
+    {
+        SG.slice_dir = pin_state[c][STEPGEN_TASK_DIR];
+        SG.slice_rest = 0;
+    }
+
+    ticks += SG.slice_rest;
+
+    // nothing to do, just hold the channel
+    if ( !n )
+    {
+        if ( fifo_put(c, STEPGEN_TASK_WAIT, 1, ticks, 0) ) return -1;
+        SG.slice_rest = 0;
+        return 0;
+    }
+
+    // direction change will take some time
+    if ( dir != SG.slice_dir )
+    {
+        ticks = ticks > (SG.dir_hold_ticks + SG.dir_setup_ticks) ?
+            ticks - (SG.dir_hold_ticks + SG.dir_setup_ticks) : n;
+    }
+
+    period = ticks / n;
+    if ( !period ) period = 1;
+
+    // no free fifo slots? the slice state isn't changed
+    if ( fifo_put(c, STEPGEN_TASK_MOVE, (uint32_t)steps, period - period / 2, period / 2) ) return -1;
+
+    SG.slice_dir = dir;
+    SG.slice_rest = ticks > period * n ? ticks - period * n : 0;
+
+    return 0;
+}
+
+static uint32_t isqrt64(uint64_t x)
+{
+    uint64_t r = 0, b = (uint64_t)1 << 62;
+
+    while ( b > x ) b >>= 2;
+
+    for ( ; b; b >>= 2 )
+    {
+        if ( x >= r + b ) { x -= r + b; r = (r >> 1) + b; }
+        else r >>= 1;
+    }
+
+    return (uint32_t) r;
+}
+
+static uint32_t ns_to_ticks(uint32_t ns)
+{
+    return (uint32_t) ( (uint64_t)ns * (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+}
+
+#if USE_STEPGEN_FOLLOW
+// v * ticks / TIMER_FREQUENCY, without 64-bit overflow
+static uint64_t per_ticks(uint64_t v, uint32_t ticks)
+{
+    return (v / TIMER_FREQUENCY) * ticks + (v % TIMER_FREQUENCY) * ticks / TIMER_FREQUENCY;
+}
+#endif
+
+#if USE_STEPGEN_NCO
+// period of the `freq` (in mHz) = period + frac/2^32 ticks
+static void nco_period_get(uint32_t freq, uint32_t * period, uint32_t * frac)
+{
+    uint64_t f = (uint64_t)TIMER_FREQUENCY * 1000;
+
+    if ( !freq || f / freq > UINT32_MAX ) { *period = UINT32_MAX; *frac = 0; return; }
+
+    *period = (uint32_t)(f / freq);
+    *frac = (uint32_t)( ((f % freq) << 32) / freq );
+}
+#endif
+
+// LOW time of the next NCO step
+static void nco_step(uint8_t c)
+{
+    nco_phase[c] += nco_frac[c];
+    task_low[c] = nco_period[c] + (nco_phase[c] < nco_frac[c] ? 1 : 0);
+    task_low[c] = task_low[c] > task_high[c] ? task_low[c] - task_high[c] : 1;
+}
+
+static void event_put(uint8_t c, uint8_t type)
+{
+#if USE_STEPGEN_EXT
+    static stepgen_event_t * e;
+
+    if ( !(SG.events & type) || events_cnt >= STEPGEN_EVENTS_SIZE ) return;
+
+    e = &events[(events_head + events_cnt++) % STEPGEN_EVENTS_SIZE];
+    e->c = c;
+    e->type = type;
+    e->pos = step_pos[c];
+    e->tick = task_tick[c];
+#endif
+}
+
+#if USE_STEPGEN_EXT
+static void events_send()
+{
+    static stepgen_event_t * e;
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    for ( ; events_cnt; events_cnt-- )
+    {
+        e = &events[events_head];
+
+        out->v[0] = e->c | ((uint32_t)e->type << 8);
+        out->v[1] = (uint32_t) e->pos;
+        out->v[2] = (uint32_t) e->tick;
+        out->v[3] = (uint32_t) (e->tick >> 32);
+
+        if ( msg_send(STEPGEN_MSG_EVENT, msg_buf, 4*4) ) return;
+
+        if ( ++events_head >= STEPGEN_EVENTS_SIZE ) events_head = 0;
+    }
+}
+#endif
+
+static void goto_next_task(uint8_t c)
+{
+    // streaming queue is below the low-water mark?
+    if ( SG.stream && !SG.stream_low && SG.queue.cnt < SG.stream_low_water )
+    {
+        SG.stream_low = 1;
+        low_water |= 1UL << c;
+    }
+
+    // no more tasks to do?
+    if ( !TASK.pulses )
+    {
+#if USE_STEPGEN_FOLLOW
+        // follower can continue with the last target velocity
+        if ( !SG.follow_ext || slice_put(c, SG.follow_ext, SG.follow_ticks) )
+#endif
+        {
+            if ( SG.stream && !task_abort[c] ) SG.stream_underruns++;
+            task_pulses[c] = 0;
+            event_put(c, STEPGEN_EVENT_QUEUE_EMPTY);
+            return;
+        }
+#if USE_STEPGEN_FOLLOW
+        SG.follow_pos += SG.follow_ext;
+        SG.follow_vel = SG.follow_ext * 65536;
+        SG.follow_ext = 0;
+#endif
+    }
+
+    task_start(c);
+}
+
+static void task_done(uint8_t c)
+{
+    // all added steps are made
+    SG.adjusted += SG.adjust;
+    SG.adjust = 0;
+
+    event_put(c, STEPGEN_EVENT_TASK_DONE);
+    pool_drop(&SG.queue);
+    goto_next_task(c);
+}
+
+static void channel_start(uint8_t c)
+{
+    task_tick[c] = tick + 9000;
+    task_start(c);
+    update_ports();
+    heap_push(c);
+}
+
+static void update_channel(uint8_t c)
+{
+    if ( task_type[c] == STEPGEN_TASK_WAIT )
+    {
+        if ( task_abort[c] ) { abort(c); return; }
+        task_done(c); // wait task done
+        return;
+    }
+    else if ( task_type[c] ) // DIR task
+    {
+        if ( task_abort[c] ) { abort(c); return; }
+        if ( task_pulses[c] > 1 ) // hold
+        {
+            task_pulses[c]--;
+            pin_state[c][STEPGEN_TASK_DIR] = pin_state[c][STEPGEN_TASK_DIR] ? 0 : 1;
+            task_tick[c] += task_high[c];
+#if USE_STEPGEN_EXT
+            if ( quad[c] ) return;
+#endif
+            update_pin(c, STEPGEN_TASK_DIR);
+        }
+        else task_done(c); // dir task done
+        return;
+    }
+#if USE_STEPGEN_EXT
+    else if ( quad[c] ) // STEP task, quadrature output
+    {
+        step_pos[c] += pin_state[c][STEPGEN_TASK_DIR] ? -1 : 1;
+        quad_put(c);
+
+        if ( ramp[c] ) // controlled deceleration
+        {
+            if ( ramp_down(c) ) { abort(c); return; }
+        }
+        else
+        {
+            if ( task_abort[c] ) { abort(c); return; }
+            if ( task_pulses[c] != UINT32_MAX ) task_pulses[c]--;
+            if ( !task_pulses[c] ) { task_done(c); return; } // step task done
+            if ( nco_period[c] ) nco_step(c);
+        }
+
+        task_tick[c] += quad_period(c);
+        return;
+    }
+#endif
+    else // STEP task
+    {
+        if ( task_dir_todo[c] ) // DIR change before the 1st step
+        {
+            if ( task_abort[c] ) { abort(c); return; }
+
+            if ( task_dir_todo[c] > 1 ) // hold time is over
+            {
+                task_dir_todo[c] = 1;
+                pin_state[c][STEPGEN_TASK_DIR] = TASK.dir - 1;
+                task_tick[c] += SG.dir_setup_ticks;
+                update_pin(c, STEPGEN_TASK_DIR);
+                return;
+            }
+
+            // setup time is over
+            task_dir_todo[c] = 0;
+            pin_state[c][STEPGEN_TASK_STEP] = 1;
+            task_tick[c] += task_high[c];
+        }
+        else if ( pin_state[c][STEPGEN_TASK_STEP] ) // high
+        {
+            pin_state[c][STEPGEN_TASK_STEP] = 0;
+            if ( nco_period[c] ) nco_step(c);
+            task_tick[c] += task_low[c];
+        }
+        else // low
+        {
+            step_pos[c] += pin_state[c][STEPGEN_TASK_DIR] ? -1 : 1;
+
+            if ( ramp[c] ) // controlled deceleration
+            {
+                if ( ramp_down(c) ) { abort(c); return; }
+                pin_state[c][STEPGEN_TASK_STEP] = 1;
+                task_tick[c] += task_high[c];
+                update_pin(c, STEPGEN_TASK_STEP);
+                return;
+            }
+
+            if ( task_abort[c] ) { abort(c); return; }
+            if ( task_pulses[c] != UINT32_MAX ) task_pulses[c]--;
+            if ( task_pulses[c] ) // have we more steps to do?
+            {
+                pin_state[c][STEPGEN_TASK_STEP] = 1;
+                task_tick[c] += task_high[c];
+            }
+            else { task_done(c); return; } // step task done
+        }
+    }
+
+    update_pin(c, STEPGEN_TASK_STEP);
+}
+
+#if USE_STEPGEN_EXT
+// STEP pin and its mirrors are on the one port?
+static uint8_t burst_masks(uint8_t c, uint32_t * set, uint32_t * clr)
+{
+    uint8_t m, t = STEPGEN_TASK_STEP;
+
+    set[0] = pin_invert[c][t] ? pin_mask[c][t] : 0; // LOW state
+    set[1] = pin_invert[c][t] ? 0 : pin_mask[c][t]; // HIGH state
+
+    for ( m = mirror_cnt[c]; m--; )
+    {
+        if ( !mirror_mask[c][m][t] ) continue;
+        if ( mirror_port[c][m][t] != pin_port[c][t] ) return 0;
+        set[0] |= mirror_invert[c][m][t] ? mirror_mask[c][m][t] : 0;
+        set[1] |= mirror_invert[c][m][t] ? 0 : mirror_mask[c][m][t];
+    }
+
+    clr[0] = set[1];
+    clr[1] = set[0];
+
+    return 1;
+}
+
+// the channel is fast enough for a burst?
+static uint8_t burst_ready(uint8_t c)
+{
+    return SG.burst_ticks && !task_type[c] && !quad[c] && !ramp[c] && !task_abort[c] &&
+        !task_dir_todo[c] && task_pulses[c] > 1 &&
+        (task_low[c] + task_high[c]) < SG.burst_ticks;
+}
+
+// make STEP edges of the channel in a tight loop
+static void burst(uint8_t c)
+{
+    static uint32_t set[2], clr[2], end;
+    static uint8_t port;
+    static int8_t d;
+
+    if ( !burst_masks(c, set, clr) ) return;
+
+    port = pin_port[c][STEPGEN_TASK_STEP];
+    d = pin_state[c][STEPGEN_TASK_DIR] ? -1 : 1;
+    end = (uint32_t)task_tick[c] + SG.burst_max_ticks;
+
+    // the last step of the task and the abort are made by update_channel()
+    while ( task_pulses[c] > 1 && !task_abort[c] && (int32_t)((uint32_t)task_tick[c] - end) < 0 )
+    {
+        // wait for the edge time
+        while ( (int32_t)(TIMER_CNT_GET() - (uint32_t)task_tick[c]) < 0 );
+
+        if ( pin_state[c][STEPGEN_TASK_STEP] ) // high
+        {
+            pin_state[c][STEPGEN_TASK_STEP] = 0;
+            GPIO_PORT_UPDATE(port, set[0], clr[0]);
+            if ( nco_period[c] ) nco_step(c);
+            task_tick[c] += task_low[c];
+        }
+        else // low
+        {
+            pin_state[c][STEPGEN_TASK_STEP] = 1;
+            GPIO_PORT_UPDATE(port, set[1], clr[1]);
+            step_pos[c] += d;
+            if ( task_pulses[c] != UINT32_MAX ) task_pulses[c]--;
+            task_tick[c] += task_high[c];
+        }
+    }
+}
+#endif
+
+static void low_water_send()
+{
+    static uint8_t c;
+    u32_10_t *out = (u32_10_t*) msg_buf;
+
+    for ( c = 0; !(low_water & (1UL << c)); c++ );
+
+    out->v[0] = c;
+    out->v[1] = stepgen_fifo_free_get(c);
+    out->v[2] = SG.stream_underruns;
+
+    if ( !msg_send(STEPGEN_MSG_LOW_WATER, msg_buf, 3*4) ) low_water &= ~(1UL << c);
+}
+
+static uint8_t ramp_down(uint8_t c)
+{
+    static uint32_t v;
+
+    // can't make one more step with this deceleration?
+    if ( SG.ramp_v2 <= 2 * (uint64_t)SG.abort_decel ) return 1;
+
+    SG.ramp_v2 -= 2 * (uint64_t)SG.abort_decel;
+
+    v = isqrt64(SG.ramp_v2);
+    v = v ? TIMER_FREQUENCY / v : UINT32_MAX;
+
+    task_low[c] = v > task_high[c] ? v - task_high[c] : 1;
+
+    return 0;
+}
+
+static void abort(uint8_t c)
+{
+    ramp[c] = 0;
+    SG.adjust = 0; // added steps of the aborted task aren't made
+
+    event_put(c, STEPGEN_EVENT_ABORT);
+
+    if ( task_abort[c] > 1 )
+    {
+        // abort tasks added before abort command only
+        uint8_t last;
+        do {
+            last = SG.queue.head == SG.abort_rec ? 1 : 0;
+            pool_drop(&SG.queue);
+        } while ( !last && SG.queue.head != POOL_NONE );
+#if USE_STEPGEN_FOLLOW
+        // don't continue the aborted follower moves
+        SG.follow_ext = 0;
+#endif
+    }
+    else pool_drop(&SG.queue);
+
+    // go to the task added after abort command
+    goto_next_task(c);
+
+    task_abort[c] = 0;
+}
+
+
+
+
+// public methods
+
+/**
+ * @brief   module init
+ * @note    call this function only once before stepgen_module_base_thread()
+ * @retval  none
+ */
+void stepgen_module_init()
+{
+    uint8_t c;
+
+    // start sys timer
+    TIMER_START();
+
+    // default DIR timings and queue sizes
+    for ( c = STEPGEN_CH_CNT; c--; )
+    {
+        stepgen_dir_setup(c, STEPGEN_DIR_SETUP_TIME, STEPGEN_DIR_HOLD_TIME);
+        pool_queue_init(&SG.queue, STEPGEN_FIFO_SIZE);
+        SG.queue_size = STEPGEN_FIFO_SIZE;
+    }
+
+    // add message handlers
+    uint8_t i = 0;
+    for ( i = STEPGEN_MSG_PIN_SETUP; i < STEPGEN_MSG_CNT; i++ )
+    {
+        msg_recv_callback_add(i, (msg_recv_func_t) stepgen_msg_recv);
+    }
+#if USE_STEPGEN_EXT
+    for ( i = STEPGEN_MSG_MIRROR_SETUP; i < STEPGEN_MSG_EXT_CNT; i++ )
+    {
+        msg_recv_callback_add(i, (msg_recv_func_t) stepgen_msg_recv);
+    }
+#endif
+}
+
+/**
+ * @brief   module base thread
+ * @note    call this function in the main loop, before gpio_module_base_thread()
+ * @retval  none
+ */
+void stepgen_module_base_thread()
+{
+    static uint8_t n;
+#if USE_STEPGEN_EXT
+    static uint8_t b;
+#endif
+
+    // get current CPU tick
+    tick = timer_cnt_get_64();
+
+    // watchdog enabled? AND it's time to abort all channels?
+    if ( wd_todo_tick && tick > wd_todo_tick )
+    {
+        // disable watchdog
+        wd_todo_tick = 0;
+        wd_expired = 1;
+        // abort all active channels
+        for ( n = heap_size; n--; ) stepgen_abort(heap[n], 1);
+    }
+
+    // take all channels with a pulse to do
+    for ( n = 0; heap_size && tick >= task_tick[heap[0]]; n++ ) due[n] = heap_pop();
+
+#if USE_STEPGEN_EXT
+    // update channels and put busy ones back
+    for ( b = STEPGEN_CH_CNT; n--; )
+    {
+        update_channel(due[n]);
+        if ( !task_pulses[due[n]] ) continue;
+        if ( b == STEPGEN_CH_CNT && burst_ready(due[n]) ) b = due[n]; // one burst per pass
+        else heap_push(due[n]);
+    }
+
+    // real update of pin states
+    if ( ports ) update_ports();
+
+    // fast channel? make its edges until the burst time is over
+    if ( b != STEPGEN_CH_CNT )
+    {
+        burst(b);
+        heap_push(b);
+    }
+#else
+    // update channels and put busy ones back
+    while ( n-- )
+    {
+        update_channel(due[n]);
+        if ( task_pulses[due[n]] ) heap_push(due[n]);
+    }
+
+    // real update of pin states
+    if ( ports ) update_ports();
+#endif
+
+    // send one low-water message per pass
+    if ( low_water ) low_water_send();
+
+#if USE_STEPGEN_EXT
+    // send events
+    if ( events_cnt ) events_send();
+#endif
+
+    // save max duration of the base thread
+    if ( (uint32_t)(TIMER_CNT_GET() - (uint32_t)tick) > loop_ticks )
+        loop_ticks = (uint32_t)(TIMER_CNT_GET() - (uint32_t)tick);
+}
+
+
+
+
+/**
+ * @brief   setup GPIO pin for the selected channel
+ *
+ * @param   c               channel id
+ * @param   type            0:step, 1:dir
+ * @param   port            GPIO port number
+ * @param   pin             GPIO pin number
+ * @param   invert          invert pin state?
+ *
+ * @retval  none
+ */
+void stepgen_pin_setup(uint8_t c, uint8_t type, uint8_t port, uint8_t pin, uint8_t invert)
+{
+    gpio_pin_setup_for_output(port, pin);
+
+    pin_state[c][type] = 0;
+    pin_port[c][type] = port;
+    pin_mask[c][type] = 1U << pin;
+    pin_invert[c][type] = invert ? 1 : 0;
+
+    update_pin(c, type);
+    update_ports();
+}
+
+#if USE_STEPGEN_EXT
+/**
+ * @brief   setup mirrored GPIO pin for the selected channel
+ *
+ * @param   c               channel id
+ * @param   m               mirror id (0 .. STEPGEN_MIRROR_CNT-1)
+ * @param   type            0:step, 1:dir
+ * @param   port            GPIO port number
+ * @param   pin             GPIO pin number
+ * @param   invert          invert pin state?
+ *
+ * @note    mirrored pins get the same edges as the channel pins
+ *          in the same port update (e.g. for the gantry axis motors)
+ *
+ * @retval  none
+ */
+void stepgen_mirror_setup(uint8_t c, uint8_t m, uint8_t type, uint8_t port, uint8_t pin, uint8_t invert)
 {
-    // we need to increase max channel ID?
-    if ( c > max_id ) max_id = c;
+    if ( m >= STEPGEN_MIRROR_CNT ) return;
+
+    gpio_pin_setup_for_output(port, pin);
+
+    mirror_port[c][m][type] = port;
+    mirror_mask[c][m][type] = 1U << pin;
+    mirror_invert[c][m][type] = invert ? 1 : 0;
+    if ( m >= mirror_cnt[c] ) mirror_cnt[c] = m + 1;
+
+    port_pin_put(port, mirror_mask[c][m][type], pin_state[c][type] ^ mirror_invert[c][m][type]);
+    update_ports();
 }
 
-static void idle(uint8_t c)
+/**
+ * @brief   enable/disable events for the selected channel
+ *
+ * @param   c       channel id
+ * @param   mask    events to send: 1:task done, 2:queue empty, 4:abort
+ *
+ * @note    every event is sent as the STEPGEN_MSG_EVENT message with
+ *          channel id | event type << 8, position, event tick (low and high words).
+ *          Up to STEPGEN_EVENTS_SIZE events are waiting for the free message slots,
+ *          newer events are lost if the buffer is full.
+ *
+ * @retval  none
+ */
+void stepgen_events_setup(uint8_t c, uint8_t mask)
 {
-    // no need to decrease max channel ID?
-    if ( !max_id || c != max_id ) return;
-    // decrease max channel ID
-    for ( max_id--; gen[max_id].tasks[SLOT].pulses; max_id-- );
+    SG.events = mask;
 }
 
-static void toggle_pin(uint8_t c, uint8_t t)
-{
-    if ( SG.pin_state[t] ^ SG.pin_invert[t] )
-        GPIO_PIN_SET(SG.pin_port[t], SG.pin_mask[t]);
-    else
-        GPIO_PIN_CLEAR(SG.pin_port[t], SG.pin_mask_not[t]);
+/**
+ * @brief   setup burst mode for the selected channel
+ *
+ * @param   c           channel id
+ * @param   period      STEP tasks with a shorter step period (in nanoseconds)
+ *                      are made in bursts, 0 = disable
+ * @param   max_time    max duration of one burst (in nanoseconds)
+ *
+ * @note    the burst makes the STEP edges of the one channel in a tight loop,
+ *          all other channels and modules wait for up to `max_time`.
+ *          The STEP pin and its mirrors must be on the one GPIO port,
+ *          the DIR changes, aborts and the last step of a task
+ *          are made by the main loop
+ *
+ * @retval  none
+ */
+void stepgen_burst_setup(uint8_t c, uint32_t period, uint32_t max_time)
+{
+    SG.burst_ticks = ns_to_ticks(period);
+    SG.burst_max_ticks = ns_to_ticks(max_time);
+}
+
+/**
+ * @brief   setup quadrature (A/B) output for the selected channel
+ *
+ * @param   c           channel id
+ * @param   enable      0 = STEP/DIR output, other values - A/B output
+ * @param   edge_time   min time between the A/B edges (in nanoseconds)
+ *
+ * @note    STEP pin is the A phase and DIR pin is the B phase.
+ *          Every step of the STEP and MOVE tasks changes the A/B state
+ *          by one position, the edge time is max(LOW + HIGH time, `edge_time`)
+ *
+ * @retval  none
+ */
+void stepgen_quad_setup(uint8_t c, uint8_t enable, uint32_t edge_time)
+{
+    quad[c] = enable ? 1 : 0;
+    quad_ticks[c] = ns_to_ticks(edge_time);
+
+    // output current position state
+    if ( quad[c] ) quad_put(c);
+    else
+    {
+        update_pin(c, STEPGEN_TASK_STEP);
+        update_pin(c, STEPGEN_TASK_DIR);
+    }
+    update_ports();
+}
+
+/**
+ * @brief   remove all mirrored pins of the selected channel
+ * @param   c   channel id
+ * @retval  none
+ */
+void stepgen_mirror_clear(uint8_t c)
+{
+    uint8_t m;
+
+    for ( m = STEPGEN_MIRROR_CNT; m--; )
+    {
+        mirror_mask[c][m][STEPGEN_TASK_STEP] = 0;
+        mirror_mask[c][m][STEPGEN_TASK_DIR] = 0;
+    }
+
+    mirror_cnt[c] = 0;
+}
+#endif
+
+
+
+
+/**
+ * @brief   add a new task for the selected channel
+ *
+ * @param   c               channel id
+ * @param   type            0:step, 1:dir, 2:wait, 3:move, 4:nco
+ * @param   pulses          number of pulses (ignored for DIR and WAIT tasks)
+ * @param   pin_low_time    pin LOW state duration (in nanoseconds)
+ * @param   pin_high_time   pin HIGH state duration (in nanoseconds)
+ *
+ * @note    WAIT task holds the channel for `pin_low_time` without any pin changes
+ * @note    MOVE task uses signed `pulses`, it sets the DIR pin by the sign
+ *          using DIR hold/setup times (stepgen_dir_setup()) before the 1st step,
+ *          INT32_MIN `pulses` value isn't accepted
+ * @note    NCO task uses `pin_low_time` as the step frequency (in mHz),
+ *          see stepgen_nco_add()
+ *
+ * @retval   0..STEPGEN_QUEUE_MAX (task added, number of free fifo slots left)
+ * @retval  -1 (task not added)
+ */
+int16_t stepgen_task_add(uint8_t c, uint8_t type, uint32_t pulses, uint32_t pin_low_time, uint32_t pin_high_time)
+{
+#if USE_STEPGEN_NCO
+    if ( type == STEPGEN_TASK_NCO ) return stepgen_nco_add(c, pulses, pin_low_time, pin_high_time);
+#else
+    if ( type == STEPGEN_TASK_NCO ) return -1;
+#endif
+
+    return stepgen_task_add_ticks(c, type, pulses, ns_to_ticks(pin_low_time), ns_to_ticks(pin_high_time));
+}
+
+/**
+ * @brief   add a new task for the selected channel
+ *
+ * @param   c               channel id
+ * @param   type            0:step, 1:dir, 2:wait, 3:move
+ * @param   pulses          number of pulses (ignored for DIR and WAIT tasks)
+ * @param   low_ticks       pin LOW state duration (in CPU ticks)
+ * @param   high_ticks      pin HIGH state duration (in CPU ticks)
+ *
+ * @retval   0..STEPGEN_QUEUE_MAX (task added, number of free fifo slots left)
+ * @retval  -1 (task not added)
+ */
+int16_t stepgen_task_add_ticks(uint8_t c, uint8_t type, uint32_t pulses, uint32_t low_ticks, uint32_t high_ticks)
+{
+    uint8_t idle = task_pulses[c] ? 0 : 1;
+
+    if ( fifo_put(c, type, pulses, low_ticks, high_ticks) ) return -1;
+
+    // start a task right now?
+    if ( idle ) channel_start(c);
+
+    return stepgen_fifo_free_get(c);
 }
 
-static void goto_next_task(uint8_t c)
+#if USE_STEPGEN_NCO
+/**
+ * @brief   add a new NCO task for the selected channel
+ *
+ * @param   c               channel id
+ * @param   pulses          number of pulses, > 0x7FFFFFFF = infinite
+ * @param   freq            step frequency (in mHz)
+ * @param   pin_high_time   pin HIGH state duration (in nanoseconds)
+ *
+ * @note    the step period is kept with 1/2^32 tick precision,
+ *          so the long-run frequency error is zero.
+ *          Use stepgen_nco_freq_set() to change the frequency on the fly.
+ *
+ * @retval   0..STEPGEN_QUEUE_MAX (task added, number of free fifo slots left)
+ * @retval  -1 (task not added)
+ */
+int16_t stepgen_nco_add(uint8_t c, uint32_t pulses, uint32_t freq, uint32_t pin_high_time)
 {
-    static uint8_t i, slot;
+    uint8_t idle = task_pulses[c] ? 0 : 1;
+    uint32_t period, frac, high = ns_to_ticks(pin_high_time);
 
-    // find next task
-    for ( i = STEPGEN_FIFO_SIZE, slot = SLOT + 1; i--; slot++ )
-    {
-        if ( slot >= STEPGEN_FIFO_SIZE ) slot = 0;
-        if ( SG.tasks[slot].pulses ) break;
-    }
+    nco_period_get(freq, &period, &frac);
+    if ( high > period / 2 ) high = period / 2;
 
-    // no more tasks to do?
-    if ( !SG.tasks[slot].pulses ) { idle(c); return; }
+    if ( fifo_put(c, STEPGEN_TASK_NCO, pulses, period, high) ) return -1;
+    pool[SG.queue.tail].delay_ticks = frac;
 
-    // save new task slot
-    SLOT = slot;
+    // start a task right now?
+    if ( idle ) channel_start(c);
 
-    // start task
-    if ( SG.tasks[slot].type ) // DIR task
-    {
-        SG.tasks[slot].pulses = 2;
-        SG.task_tick += SG.tasks[slot].low_ticks;
-    }
-    else // STEP task
-    {
-        SG.task_infinite = SG.tasks[slot].pulses > INT32_MAX ? 1 : 0;
-        SG.pin_state[SG.tasks[slot].type] = 1;
-        SG.task_tick += SG.tasks[slot].high_ticks;
-        toggle_pin(c, SG.tasks[slot].type);
-    }
+    return stepgen_fifo_free_get(c);
 }
 
-static void abort(uint8_t c)
+/**
+ * @brief   change step frequency of the current NCO task
+ *
+ * @param   c       channel id
+ * @param   freq    step frequency (in mHz)
+ *
+ * @note    the phase is kept, so the next step comes without a glitch
+ *
+ * @retval  none
+ */
+void stepgen_nco_freq_set(uint8_t c, uint32_t freq)
 {
-    if ( SG.abort > 1 )
-    {
-        // fifo cleanup
-        uint8_t i;
-        for ( i = STEPGEN_FIFO_SIZE; i--; )
-        {
-            // abort tasks added before abort command only
-            if ( SG.tasks[i].pulses && SG.tasks[i].tick < SG.abort_tick ) {
-                SG.tasks[i].pulses = 0;
-            }
-        }
-        // free channel id
-        idle(c);
-    }
-    else
-    {
-        TASK.pulses = 0;
-        goto_next_task(c);
-    }
+    if ( !nco_period[c] ) return;
 
-    SG.abort = 0;
+    nco_period_get(freq, &nco_period[c], &nco_frac[c]);
 }
+#endif
 
 
 
 
-// public methods
-
 /**
- * @brief   module init
- * @note    call this function only once before stepgen_module_base_thread()
- * @retval  none
+ * @brief   add steps which must be done in the selected time
+ *
+ * @param   c       channel id
+ * @param   steps   number of steps, the sign is a direction
+ * @param   ticks   time to make all steps (in CPU ticks)
+ *
+ * @note    steps are distributed evenly, the DIR change uses dir setup/hold times
+ *          and the fractional ticks are added to the next slice
+ *
+ * @retval   0 (steps added)
+ * @retval  -1 (no free fifo slots)
  */
-void stepgen_module_init()
+int8_t stepgen_slice_add(uint8_t c, int32_t steps, uint32_t ticks)
 {
-    // start sys timer
-    TIMER_START();
+    uint8_t idle = task_pulses[c] ? 0 : 1;
 
-    // add message handlers
-    uint8_t i = 0;
-    for ( i = STEPGEN_MSG_PIN_SETUP; i < STEPGEN_MSG_CNT; i++ )
-    {
-        msg_recv_callback_add(i, (msg_recv_func_t) stepgen_msg_recv);
-    }
+    if ( slice_put(c, steps, ticks) ) return -1;
+
+    // start a task right now?
+    if ( idle ) channel_start(c);
+
+    return 0;
 }
 
 /**
- * @brief   module base thread
- * @note    call this function in the main loop, before gpio_module_base_thread()
- * @retval  none
+ * @brief   add or remove steps of the current STEP task
+ *
+ * @param   c       channel id
+ * @param   steps   number of steps, the sign is a direction
+ *
+ * @note    steps in the task direction make the task longer,
+ *          steps against it make the task shorter (the last step is kept).
+ *          Infinite, decelerating and not yet started tasks are not changed.
+ *          The added steps are counted by stepgen_steps_adjusted_get()
+ *          when the task is done.
+ *
+ * @retval  number of steps added (with the sign)
  */
-void stepgen_module_base_thread()
+int32_t stepgen_steps_adjust(uint8_t c, int32_t steps)
 {
-    static uint8_t c;
+    uint32_t n = steps < 0 ? -steps : steps;
 
-    // get current CPU tick
-    tick = timer_cnt_get_64();
+    // no running STEP task?
+    if ( !task_pulses[c] || task_pulses[c] == UINT32_MAX || task_type[c] ) return 0;
+    if ( ramp[c] || task_abort[c] || task_dir_todo[c] || !n ) return 0;
 
-    // watchdog enabled? AND it's time to abort all channels?
-    if ( wd_todo_tick && tick > wd_todo_tick )
+    // same direction, make more steps
+    if ( (steps < 0) == (pin_state[c][STEPGEN_TASK_DIR] ? 1 : 0) )
     {
-        // disable watchdog
-        wd_todo_tick = 0;
-        // abort all active channels
-        for ( c = max_id + 1; c--; ) if ( TASK.pulses ) stepgen_abort(c, 1);
+        if ( n > INT32_MAX - task_pulses[c] ) n = INT32_MAX - task_pulses[c];
+        task_pulses[c] += n;
+        SG.adjust += steps < 0 ? -(int32_t)n : (int32_t)n;
+        return steps < 0 ? -(int32_t)n : (int32_t)n;
     }
 
-    // check all working channels
-    for ( c = max_id + 1; c--; )
-    {
-        // channel disabled?
-        if ( !TASK.pulses ) continue;
-        // it's not a time for a pulse?
-        if ( tick < SG.task_tick ) continue;
+    // opposite direction, skip some steps
+    if ( n > task_pulses[c] - 1 ) n = task_pulses[c] - 1;
+    task_pulses[c] -= n;
+    SG.adjust += steps < 0 ? -(int32_t)n : (int32_t)n;
+    return steps < 0 ? -(int32_t)n : (int32_t)n;
+}
 
-        if ( TASK.type ) // DIR task
-        {
-            if ( SG.abort ) { abort(c); continue; }
-            if ( TASK.pulses > 1 ) // hold
-            {
-                SG.pin_state[TASK.type] = SG.pin_state[TASK.type] ? 0 : 1;
-                SG.task_tick += TASK.high_ticks;
-            }
-            else goto_next_task(c); // dir task done
+/**
+ * @brief   get number of the steps added by stepgen_steps_adjust() and already made
+ *
+ * @param   c   channel id
+ *
+ * @note    steps of the current task are counted when the task is done,
+ *          steps of the aborted task aren't counted.
+ *          The follower positions don't include these steps.
+ *
+ * @retval  number of steps (with the sign)
+ */
+int32_t stepgen_steps_adjusted_get(uint8_t c)
+{
+    return SG.adjusted;
+}
 
-            TASK.pulses--;
-        }
-        else // STEP task
-        {
-            if ( SG.pin_state[TASK.type] ) // high
-            {
-                SG.pin_state[TASK.type] = 0;
-                SG.task_tick += TASK.low_ticks;
-            }
-            else // low
-            {
-                SG.pos += SG.pin_state[1] ? -1 : 1;
-
-                if ( SG.abort ) { abort(c); continue; }
-                if ( !SG.task_infinite ) TASK.pulses--;
-                if ( TASK.pulses ) // have we more steps to do?
-                {
-                    SG.pin_state[TASK.type] = 1;
-                    SG.task_tick += TASK.high_ticks;
-                }
-                else goto_next_task(c); // step task done
-            }
-        }
+/**
+ * @brief   get number of free fifo slots for the selected channel
+ * @param   c   channel id
+ * @note    the channel queue uses records of the shared pool (mod_pool.h)
+ *          and it's limited by the queue size (stepgen_stream_setup())
+ * @retval  0..STEPGEN_QUEUE_MAX
+ */
+uint16_t stepgen_fifo_free_get(uint8_t c)
+{
+    uint16_t free = SG.queue_size - SG.queue.cnt;
 
-        toggle_pin(c, TASK.type);
-    }
+    return pool_avail_get(&SG.queue) < free ? pool_avail_get(&SG.queue) : free;
+}
+
+/**
+ * @brief   setup DIR pin timings for the selected channel
+ *
+ * @param   c           channel id
+ * @param   setup_time  DIR pin setup time before the 1st step (in nanoseconds)
+ * @param   hold_time   DIR pin hold time after the last step (in nanoseconds)
+ *
+ * @note    these timings are used by the MOVE tasks
+ *
+ * @retval  none
+ */
+void stepgen_dir_setup(uint8_t c, uint32_t setup_time, uint32_t hold_time)
+{
+    SG.dir_setup_ticks = ns_to_ticks(setup_time);
+    SG.dir_hold_ticks = ns_to_ticks(hold_time);
 }
 
 
 
 
 /**
- * @brief   setup GPIO pin for the selected channel
+ * @brief   setup streaming mode for the selected channel
  *
- * @param   c               channel id
- * @param   type            0:step, 1:dir
- * @param   port            GPIO port number
- * @param   pin             GPIO pin number
- * @param   invert          invert pin state?
+ * @param   c           channel id
+ * @param   enable      0 = disable, other values - enable
+ * @param   low_water   number of queued tasks to send the low-water message below
+ * @param   queue_size  max number of queued tasks, 0 = STEPGEN_FIFO_SIZE
+ *
+ * @note    in streaming mode every STEPGEN_MSG_TASK_ADD message gets a reply
+ *          with the number of free fifo slots (credits), -1 if the task wasn't added.
+ *          When the queue drains below `low_water`, the STEPGEN_MSG_LOW_WATER
+ *          message is sent with the channel id, credits and underruns count.
+ * @note    the underruns counter is reset by this call
+ * @note    all channel queues use the same pool of task records,
+ *          STEPGEN_FIFO_SIZE records are reserved to every channel,
+ *          the tasks over it use the spare records of the pool
  *
  * @retval  none
  */
-void stepgen_pin_setup(uint8_t c, uint8_t type, uint8_t port, uint8_t pin, uint8_t invert)
+void stepgen_stream_setup(uint8_t c, uint8_t enable, uint16_t low_water, uint16_t queue_size)
 {
-    gpio_pin_setup_for_output(port, pin);
+    if ( !queue_size ) queue_size = STEPGEN_FIFO_SIZE;
+    SG.queue_size = queue_size > STEPGEN_QUEUE_MAX ? STEPGEN_QUEUE_MAX : queue_size;
 
-    SG.pin_state[type] = 0;
-    SG.pin_port[type] = port;
-    SG.pin_mask[type] = 1U << pin;
-    SG.pin_mask_not[type] = ~(SG.pin_mask[type]);
-    SG.pin_invert[type] = invert ? 1 : 0;
+    SG.stream = enable ? 1 : 0;
+    SG.stream_low_water = low_water > SG.queue_size ? SG.queue_size : low_water;
+    SG.stream_low = SG.queue.cnt < SG.stream_low_water ? 1 : 0;
+    SG.stream_underruns = 0;
+}
 
-    toggle_pin(c, type);
+/**
+ * @brief   get number of underruns for the selected channel
+ * @param   c   channel id
+ * @note    underrun is the moment when the streaming channel has no more tasks to do
+ * @retval  0..0xFFFFFFFF
+ */
+uint32_t stepgen_stream_underruns_get(uint8_t c)
+{
+    return SG.stream_underruns;
 }
 
 
 
 
 /**
- * @brief   add a new task for the selected channel
+ * @brief   update time values for the current task
  *
  * @param   c               channel id
  * @param   type            0:step, 1:dir
- * @param   pulses          number of pulses (ignored for DIR task)
  * @param   pin_low_time    pin LOW state duration (in nanoseconds)
  * @param   pin_high_time   pin HIGH state duration (in nanoseconds)
  *
  * @retval  none
  */
-void stepgen_task_add(uint8_t c, uint8_t type, uint32_t pulses, uint32_t pin_low_time, uint32_t pin_high_time)
+void stepgen_task_update(uint8_t c, uint8_t type, uint32_t pin_low_time, uint32_t pin_high_time)
 {
-    uint8_t i, slot;
+    // is idle OR task type is different?
+    if ( !task_pulses[c] || task_type[c] != type ) return;
 
-    if ( TASK.pulses )
-    {
-        // find free fifo slot for the new task
-        for ( i = STEPGEN_FIFO_SIZE, slot = SLOT; i--; slot++ )
-        {
-            if ( slot >= STEPGEN_FIFO_SIZE ) slot = 0;
-            if ( !SG.tasks[slot].pulses ) break;
-        }
+    task_low[c] = (uint32_t) ( (uint64_t)pin_low_time *
+        (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+    task_high[c] = (uint32_t) ( (uint64_t)pin_high_time *
+        (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+}
 
-        // no free slots?
-        if ( SG.tasks[slot].pulses ) return;
-    }
-    else slot = SLOT;
 
-    busy(c);
 
-    SG.tasks[slot].tick = tick;
-    SG.tasks[slot].type = type;
-    SG.tasks[slot].pulses = type ? 2 : pulses;
-    SG.tasks[slot].low_ticks = (uint32_t) ( (uint64_t)pin_low_time *
-        (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
-    SG.tasks[slot].high_ticks = (uint32_t) ( (uint64_t)pin_high_time *
-        (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
 
-    // start a task right now?
-    if ( slot == SLOT )
+#if USE_STEPGEN_FOLLOW
+/**
+ * @brief   setup position follower mode for the selected channel
+ *
+ * @param   c           channel id
+ * @param   enable      0 = disable, other values - enable
+ * @param   period      target update period (in nanoseconds)
+ * @param   max_vel     max velocity (in steps per second)
+ * @param   max_accel   max acceleration (in steps per second^2)
+ *
+ * @retval  none
+ */
+void stepgen_follow_setup(uint8_t c, uint8_t enable, uint32_t period, uint32_t max_vel, uint32_t max_accel)
+{
+    uint64_t v;
+
+    SG.follow = enable ? 1 : 0;
+    SG.follow_ext = 0;
+    SG.follow_ticks = ns_to_ticks(period);
+
+    // steps per period, Q16
+    v = per_ticks((uint64_t)max_vel << 16, SG.follow_ticks);
+    SG.follow_max_vel = v > INT32_MAX ? INT32_MAX : (uint32_t)v;
+    v = per_ticks(per_ticks((uint64_t)max_accel << 16, SG.follow_ticks), SG.follow_ticks);
+    SG.follow_max_accel = v > INT32_MAX ? INT32_MAX : (v ? (uint32_t)v : 1);
+}
+
+/**
+ * @brief   set new target position for the channel in position follower mode
+ *
+ * @param   c       channel id
+ * @param   pos     position (in steps) to reach by the end of the next period
+ * @param   vel     target velocity (in steps per second), 0 = unknown
+ *
+ * @note    the channel makes steps to reach the `pos` by the end of the period,
+ *          velocity and acceleration are limited by stepgen_follow_setup() values.
+ *          If `vel` is set and the next target will be late,
+ *          the channel continues moving with this velocity for one more period.
+ *
+ * @retval  none
+ */
+void stepgen_target_set(uint8_t c, int32_t pos, int32_t vel)
+{
+    int64_t e, r, vt, v;
+    uint32_t dv;
+    int32_t n;
+
+    if ( !SG.follow ) return;
+
+    // channel is idle? start from the current position after half of the period
+    if ( !task_pulses[c] )
     {
-        SG.task_tick = tick + 9000;
+        SG.follow_pos = step_pos[c] - SG.adjusted;
+        SG.follow_vel = 0;
+        SG.follow_frac = 0;
+        SG.follow_target = pos;
+        stepgen_task_add_ticks(c, STEPGEN_TASK_WAIT, 1, SG.follow_ticks / 2, 0);
+    }
 
-        if ( type )
-        {
-            SG.task_tick += SG.tasks[slot].low_ticks;
-        }
-        else
-        {
-            SG.task_infinite = SG.tasks[slot].pulses > INT32_MAX ? 1 : 0;
-            SG.pin_state[type] = 1;
-            SG.task_tick += SG.tasks[slot].high_ticks;
-            toggle_pin(c, type);
-        }
+    // target velocity (steps/period, Q16)
+    if ( vel )
+    {
+        vt = (int64_t) per_ticks((uint64_t)(vel < 0 ? -vel : vel) << 16, SG.follow_ticks);
+        if ( vel < 0 ) vt = -vt;
     }
+    else vt = (int64_t)(pos - SG.follow_target) * 65536;
+
+    // velocity to reach the target by the end of the period
+    e = (int64_t)(pos - SG.follow_pos) * 65536;
+
+    // the rest of error must be reachable with the max acceleration
+    r = e - vt;
+    dv = isqrt64( 2 * (uint64_t)SG.follow_max_accel * (uint64_t)(r < 0 ? -r : r) );
+    if ( r > (int64_t)dv ) v = vt + dv;
+    else if ( r < -(int64_t)dv ) v = vt - dv;
+    else v = e;
+
+    // acceleration and velocity limits
+    if ( v > (int64_t)SG.follow_vel + SG.follow_max_accel ) v = (int64_t)SG.follow_vel + SG.follow_max_accel;
+    if ( v < (int64_t)SG.follow_vel - SG.follow_max_accel ) v = (int64_t)SG.follow_vel - SG.follow_max_accel;
+    if ( v > (int64_t)SG.follow_max_vel ) v = SG.follow_max_vel;
+    if ( v < -(int64_t)SG.follow_max_vel ) v = -(int64_t)SG.follow_max_vel;
+
+    // whole steps of this slice, the fraction goes to the next one
+    n = (int32_t)( (v + SG.follow_frac) >> 16 );
+
+    SG.follow_target = pos;
+
+    if ( stepgen_slice_add(c, n, SG.follow_ticks) ) return;
+
+    SG.follow_frac = (int32_t)( v + SG.follow_frac - (int64_t)n * 65536 );
+    SG.follow_pos += n;
+    SG.follow_vel = (int32_t) v;
+    SG.follow_ext = (int32_t)( (vt + 32768) >> 16 );
+    if ( !vel ) SG.follow_ext = 0;
 }
 
 /**
- * @brief   update time values for the current task
+ * @brief   start the follower from the end of the queued tasks
  *
- * @param   c               channel id
- * @param   type            0:step, 1:dir
- * @param   pin_low_time    pin LOW state duration (in nanoseconds)
- * @param   pin_high_time   pin HIGH state duration (in nanoseconds)
+ * @param   c       channel id
+ * @param   pos     position (in steps) at the end of the queued tasks
+ * @param   vel     velocity (in steps per second) at the end of the queued tasks
+ *
+ * @note    use it to hand the moving channel over to the follower without a stop,
+ *          call it after stepgen_follow_setup() and before stepgen_target_set()
  *
  * @retval  none
  */
-void stepgen_task_update(uint8_t c, uint8_t type, uint32_t pin_low_time, uint32_t pin_high_time)
+void stepgen_follow_start(uint8_t c, int32_t pos, int32_t vel)
 {
-    // is idle OR task type is different?
-    if ( !TASK.pulses || SG.tasks[SLOT].type != type ) return;
+    uint64_t v;
 
-    TASK.low_ticks = (uint32_t) ( (uint64_t)pin_low_time *
-        (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
-    TASK.high_ticks = (uint32_t) ( (uint64_t)pin_high_time *
-        (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000 );
+    if ( !SG.follow ) return;
+
+    v = per_ticks((uint64_t)(vel < 0 ? -(int64_t)vel : vel) << 16, SG.follow_ticks);
+    if ( v > SG.follow_max_vel ) v = SG.follow_max_vel;
+
+    SG.follow_pos = pos;
+    SG.follow_vel = vel < 0 ? -(int32_t)v : (int32_t)v;
+    SG.follow_frac = 0;
+    SG.follow_target = pos;
+
+    // keep the channel busy, so stepgen_target_set() doesn't start from the rest
+    if ( !task_pulses[c] ) stepgen_task_add_ticks(c, STEPGEN_TASK_WAIT, 1, SG.follow_ticks / 2, 0);
+}
+
+/**
+ * @brief   get the follower position at the end of the queued slices
+ * @param   c   channel id
+ * @retval  steps
+ */
+int32_t stepgen_follow_pos_get(uint8_t c)
+{
+    return SG.follow_pos;
+}
+
+/**
+ * @brief   get the follower velocity of the last queued slice
+ * @param   c   channel id
+ * @retval  steps per second, the sign is a direction
+ */
+int32_t stepgen_follow_vel_get(uint8_t c)
+{
+    uint64_t v;
+
+    if ( !SG.follow_ticks ) return 0;
+
+    v = (uint64_t)(SG.follow_vel < 0 ? -(int64_t)SG.follow_vel : SG.follow_vel) * TIMER_FREQUENCY / SG.follow_ticks >> 16;
+    if ( v > INT32_MAX ) v = INT32_MAX;
+
+    return SG.follow_vel < 0 ? -(int32_t)v : (int32_t)v;
 }
+#endif
 
 
 
 
 /**
  * @brief   abort all tasks for the selected channel
+ *
  * @param   c       channel id
  * @param   all     abort all task?
+ *
+ * @note    if the abort deceleration is set (stepgen_abort_setup()),
+ *          the current STEP task slows down to zero before the abort
+ *
  * @retval  none
  */
 void stepgen_abort(uint8_t c, uint8_t all)
 {
-    SG.abort = all ? 2 : 1;
-    SG.abort_tick = tick;
+    static uint32_t v;
+
+    if ( !task_pulses[c] ) return;
+
+    // a later `abort all` still widens the running deceleration abort
+    if ( all || !task_abort[c] ) { task_abort[c] = all ? 2 : 1; SG.abort_rec = SG.queue.tail; }
+
+    if ( ramp[c] ) return;
+
+    // stop at the next edge?
+    if ( !SG.abort_decel || task_type[c] || task_dir_todo[c] ) return;
+
+    // current velocity, steps/s
+#if USE_STEPGEN_EXT
+    v = quad[c] ? quad_period(c) : task_low[c] + task_high[c];
+#else
+    v = task_low[c] + task_high[c];
+#endif
+    v = v ? TIMER_FREQUENCY / v : 0;
+
+    SG.ramp_v2 = (uint64_t)v * (uint64_t)v;
+    ramp[c] = 1;
+    nco_period[c] = 0; // the ramp sets the step period now
+}
+
+/**
+ * @brief   setup controlled deceleration for the aborts
+ *
+ * @param   c       channel id
+ * @param   decel   deceleration (in steps per second^2), 0 = stop at the next edge
+ *
+ * @note    used by stepgen_abort() and by the watchdog
+ *
+ * @retval  none
+ */
+void stepgen_abort_setup(uint8_t c, uint32_t decel)
+{
+    SG.abort_decel = decel;
 }
 
 
 
 
+/**
+ * @brief   get channel state
+ * @param   c   channel id
+ * @retval  0 (channel is idle)
+ * @retval  1 (channel is busy)
+ */
+uint8_t stepgen_state_get(uint8_t c)
+{
+    return task_pulses[c] ? 1 : 0;
+}
+
 /**
  * @brief   set channel steps position
  * @param   c   channel id
@@ -336,18 +1466,20 @@ void stepgen_abort(uint8_t c, uint8_t all)
  */
 int32_t stepgen_pos_get(uint8_t c)
 {
-    return SG.pos;
+    return step_pos[c];
 }
 
 /**
  * @brief   set channel steps position
  * @param   c       channel id
  * @param   pos     integer 4-bytes
+ * @note    it also resets the stepgen_steps_adjusted_get() steps
  * @retval  none
  */
 void stepgen_pos_set(uint8_t c, int32_t pos)
 {
-    SG.pos = pos;
+    step_pos[c] = pos;
+    SG.adjusted = 0;
 }
 
 
@@ -361,6 +1493,8 @@ void stepgen_pos_set(uint8_t c, int32_t pos)
  */
 void stepgen_watchdog_setup(uint8_t enable, uint32_t time)
 {
+    wd_expired = 0;
+
     if ( !enable ) { wd_todo_tick = 0; return; }
 
     wd_ticks = (uint64_t)time * (uint64_t)TIMER_FREQUENCY_MHZ / (uint64_t)1000;
@@ -370,6 +1504,35 @@ void stepgen_watchdog_setup(uint8_t enable, uint32_t time)
 
 
 
+/**
+ * @brief   check the `abort all` watchdog state
+ * @note    the state will be reset by the next stepgen_watchdog_setup() call
+ * @retval  0 (watchdog is disabled or still waiting)
+ * @retval  1 (watchdog time was over and all channels were aborted)
+ */
+uint8_t stepgen_watchdog_expired()
+{
+    return wd_expired;
+}
+
+
+
+
+/**
+ * @brief   get max duration of the base thread since the last call
+ * @note    use it to measure the step generation overhead
+ * @retval  0..0xFFFFFFFF (CPU ticks)
+ */
+uint32_t stepgen_loop_ticks_get()
+{
+    uint32_t ticks = loop_ticks;
+    loop_ticks = 0;
+    return ticks;
+}
+
+
+
+
 /**
  * @brief   "message received" callback
  *
@@ -397,7 +1560,8 @@ int8_t volatile stepgen_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
             stepgen_pin_setup(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4]);
             break;
         case STEPGEN_MSG_TASK_ADD:
-            stepgen_task_add(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4]);
+            out->v[0] = (uint32_t)(int32_t) stepgen_task_add(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4]);
+            if ( in->v[0] < STEPGEN_CH_CNT && gen[in->v[0]].stream ) msg_send(type, msg_buf, 4);
             break;
         case STEPGEN_MSG_TASK_UPDATE:
             stepgen_task_update(in->v[0], in->v[1], in->v[2], in->v[3]);
@@ -405,6 +1569,39 @@ int8_t volatile stepgen_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
         case STEPGEN_MSG_ABORT:
             stepgen_abort(in->v[0], in->v[1]);
             break;
+        case STEPGEN_MSG_ABORT_SETUP:
+            stepgen_abort_setup(in->v[0], in->v[1]);
+            break;
+        case STEPGEN_MSG_STREAM_SETUP:
+            stepgen_stream_setup(in->v[0], in->v[1], in->v[2], length >= 16 ? in->v[3] : 0);
+            break;
+#if USE_STEPGEN_EXT
+        case STEPGEN_MSG_MIRROR_SETUP:
+            stepgen_mirror_setup(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4], in->v[5]);
+            break;
+        case STEPGEN_MSG_MIRROR_CLEAR:
+            stepgen_mirror_clear(in->v[0]);
+            break;
+        case STEPGEN_MSG_QUAD_SETUP:
+            stepgen_quad_setup(in->v[0], in->v[1], in->v[2]);
+            break;
+        case STEPGEN_MSG_EVENTS_SETUP:
+            stepgen_events_setup(in->v[0], in->v[1]);
+            break;
+        case STEPGEN_MSG_BURST_SETUP:
+            stepgen_burst_setup(in->v[0], in->v[1], in->v[2]);
+            break;
+#endif
+#if USE_STEPGEN_NCO
+        case STEPGEN_MSG_NCO_FREQ_SET:
+            stepgen_nco_freq_set(in->v[0], in->v[1]);
+            break;
+#endif
+        case STEPGEN_MSG_STREAM_STATE_GET:
+            out->v[0] = stepgen_fifo_free_get(in->v[0]);
+            out->v[1] = stepgen_stream_underruns_get(in->v[0]);
+            msg_send(type, msg_buf, 2*4);
+            break;
         case STEPGEN_MSG_POS_GET:
             out->v[0] = (uint32_t) stepgen_pos_get(in->v[0]);
             msg_send(type, msg_buf, 4);
@@ -415,6 +1612,21 @@ int8_t volatile stepgen_msg_recv(uint8_t type, uint8_t * msg, uint8_t length)
         case STEPGEN_MSG_WATCHDOG_SETUP:
             stepgen_watchdog_setup(in->v[0], in->v[1]);
             break;
+        case STEPGEN_MSG_DIR_SETUP:
+            stepgen_dir_setup(in->v[0], in->v[1], in->v[2]);
+            break;
+#if USE_STEPGEN_FOLLOW
+        case STEPGEN_MSG_FOLLOW_SETUP:
+            stepgen_follow_setup(in->v[0], in->v[1], in->v[2], in->v[3], in->v[4]);
+            break;
+        case STEPGEN_MSG_TARGET_SET:
+            stepgen_target_set(in->v[0], (int32_t)in->v[1], length >= 12 ? (int32_t)in->v[2] : 0);
+            break;
+#endif
+        case STEPGEN_MSG_LOOP_TICKS_GET:
+            out->v[0] = stepgen_loop_ticks_get();
+            msg_send(type, msg_buf, 4);
+            break;
 
         default: return -1;
     }
@@ -10,14 +10,21 @@
 #include <stdint.h>
 #include "mod_msg.h"
 #include "mod_timer.h"
+#include "mod_pool.h"
 
 
 
 
 #define STEPGEN_CH_CNT          24  ///< maximum number of pulse generator channels
-#define STEPGEN_FIFO_SIZE       4   ///< size of channel's fifo buffer
+#define STEPGEN_FIFO_SIZE       4   ///< default size of channel's tasks queue
+#define STEPGEN_QUEUE_MAX       (STEPGEN_FIFO_SIZE + POOL_SPARE) ///< max size of channel's tasks queue
+#define STEPGEN_MIRROR_CNT      3   ///< max number of mirrored STEP/DIR pin pairs
+#define STEPGEN_EVENTS_SIZE     16  ///< size of the events buffer
 #define STEPGEN_MSG_BUF_LEN     MSG_LEN
 
+#define STEPGEN_DIR_SETUP_TIME  5000    ///< default DIR setup time (in nanoseconds)
+#define STEPGEN_DIR_HOLD_TIME   5000    ///< default DIR hold time (in nanoseconds)
+
 enum
 {
     STEPGEN_MSG_PIN_SETUP = 0x20,
@@ -27,39 +34,100 @@ enum
     STEPGEN_MSG_POS_GET,
     STEPGEN_MSG_POS_SET,
     STEPGEN_MSG_WATCHDOG_SETUP,
+    STEPGEN_MSG_LOOP_TICKS_GET,
+    STEPGEN_MSG_DIR_SETUP,
+    STEPGEN_MSG_FOLLOW_SETUP,
+    STEPGEN_MSG_TARGET_SET,
+    STEPGEN_MSG_ABORT_SETUP,
+    STEPGEN_MSG_STREAM_SETUP,
+    STEPGEN_MSG_STREAM_STATE_GET,
+    STEPGEN_MSG_LOW_WATER, // ARISC -> ARM only
+    STEPGEN_MSG_NCO_FREQ_SET,
     STEPGEN_MSG_CNT
 };
 
+/// more message types (the 1st range is full)
+enum
+{
+    STEPGEN_MSG_MIRROR_SETUP = 0x60,
+    STEPGEN_MSG_MIRROR_CLEAR,
+    STEPGEN_MSG_QUAD_SETUP,
+    STEPGEN_MSG_EVENTS_SETUP,
+    STEPGEN_MSG_EVENT, // ARISC -> ARM only
+    STEPGEN_MSG_BURST_SETUP,
+    STEPGEN_MSG_EXT_CNT
+};
+
+/// task types
+enum
+{
+    STEPGEN_TASK_STEP,
+    STEPGEN_TASK_DIR,
+    STEPGEN_TASK_WAIT,
+    STEPGEN_TASK_MOVE,
+    STEPGEN_TASK_NCO
+};
+
+/// event types (bit mask)
+enum
+{
+    STEPGEN_EVENT_TASK_DONE = 1,
+    STEPGEN_EVENT_QUEUE_EMPTY = 2,
+    STEPGEN_EVENT_ABORT = 4
+};
+
 
 
 
 typedef struct
 {
-    uint8_t     type; // 0:step, 1:dir
-    uint32_t    pulses; // 0:empty slot, !0:used
-    uint32_t    low_ticks;
-    uint32_t    high_ticks;
+    uint8_t     c; // channel id
+    uint8_t     type;
+    int32_t     pos;
     uint64_t    tick;
 
-} stepgen_fifo_slot_t;
+} stepgen_event_t;
 
 typedef struct
 {
-    uint8_t     pin_state[2];
-    uint8_t     pin_port[2];
-    uint32_t    pin_mask[2];
-    uint32_t    pin_mask_not[2];
-    uint32_t    pin_invert[2];
+#if USE_STEPGEN_EXT
+    uint8_t     events; // mask of events to send
 
-    int32_t     pos; // in pulses
+    uint32_t    burst_ticks; // STEP tasks with a shorter period are made in bursts
+    uint32_t    burst_max_ticks; // max duration of one burst
+#endif
 
-    uint8_t     abort;
-    uint64_t    abort_tick;
+    uint16_t    abort_rec; // last task to abort
+    uint32_t    abort_decel; // steps/s^2, 0 = stop at the next edge
+    uint64_t    ramp_v2; // velocity^2, (steps/s)^2
+
+    pool_queue_t    queue; // tasks: 0:step, 1:dir, 2:wait, 4:nco
+    uint16_t        queue_size; // max number of queued tasks
+
+    uint8_t     slice_dir; // DIR state at the end of the fifo
+    uint32_t    slice_rest; // unused ticks of the last slice
+    uint32_t    dir_setup_ticks;
+    uint32_t    dir_hold_ticks;
+
+    uint8_t     stream; // streaming mode
+    uint8_t     stream_low; // queue is below the low-water mark
+    uint16_t    stream_low_water;
+    uint32_t    stream_underruns;
+
+#if USE_STEPGEN_FOLLOW
+    uint8_t     follow; // position follower mode
+    uint32_t    follow_ticks; // target update period
+    uint32_t    follow_max_vel; // steps/period, Q16
+    uint32_t    follow_max_accel; // steps/period^2, Q16
+    int32_t     follow_pos; // position at the end of the fifo
+    int32_t     follow_vel; // last velocity, steps/period, Q16
+    int32_t     follow_frac; // fraction of a step left by the last slice, Q16
+    int32_t     follow_ext; // extrapolation steps for the late target
+    int32_t     follow_target; // last target position
+#endif
 
-    uint8_t                 task_infinite;
-    uint8_t                 task_slot;
-    uint64_t                task_tick;
-    stepgen_fifo_slot_t     tasks[STEPGEN_FIFO_SIZE];
+    int32_t     adjust; // steps added to the current task by stepgen_steps_adjust()
+    int32_t     adjusted; // added steps of the done tasks
 
 } stepgen_ch_t;
 
@@ -69,11 +137,35 @@ typedef struct
 void stepgen_module_init();
 void stepgen_module_base_thread();
 void stepgen_pin_setup(uint8_t c, uint8_t type, uint8_t port, uint8_t pin, uint8_t invert);
-void stepgen_task_add(uint8_t c, uint8_t type, uint32_t pulses, uint32_t pin_low_time, uint32_t pin_high_time);
+void stepgen_mirror_setup(uint8_t c, uint8_t m, uint8_t type, uint8_t port, uint8_t pin, uint8_t invert);
+void stepgen_mirror_clear(uint8_t c);
+void stepgen_quad_setup(uint8_t c, uint8_t enable, uint32_t edge_time);
+void stepgen_events_setup(uint8_t c, uint8_t mask);
+void stepgen_burst_setup(uint8_t c, uint32_t period, uint32_t max_time);
+int16_t stepgen_task_add(uint8_t c, uint8_t type, uint32_t pulses, uint32_t pin_low_time, uint32_t pin_high_time);
+int16_t stepgen_task_add_ticks(uint8_t c, uint8_t type, uint32_t pulses, uint32_t low_ticks, uint32_t high_ticks);
+int16_t stepgen_nco_add(uint8_t c, uint32_t pulses, uint32_t freq, uint32_t pin_high_time);
+void stepgen_nco_freq_set(uint8_t c, uint32_t freq);
+int8_t stepgen_slice_add(uint8_t c, int32_t steps, uint32_t ticks);
+int32_t stepgen_steps_adjust(uint8_t c, int32_t steps);
+int32_t stepgen_steps_adjusted_get(uint8_t c);
+uint16_t stepgen_fifo_free_get(uint8_t c);
+void stepgen_dir_setup(uint8_t c, uint32_t setup_time, uint32_t hold_time);
+void stepgen_stream_setup(uint8_t c, uint8_t enable, uint16_t low_water, uint16_t queue_size);
+uint32_t stepgen_stream_underruns_get(uint8_t c);
+void stepgen_follow_setup(uint8_t c, uint8_t enable, uint32_t period, uint32_t max_vel, uint32_t max_accel);
+void stepgen_target_set(uint8_t c, int32_t pos, int32_t vel);
+void stepgen_follow_start(uint8_t c, int32_t pos, int32_t vel);
+int32_t stepgen_follow_pos_get(uint8_t c);
+int32_t stepgen_follow_vel_get(uint8_t c);
 void stepgen_abort(uint8_t c, uint8_t all);
+void stepgen_abort_setup(uint8_t c, uint32_t decel);
+uint8_t stepgen_state_get(uint8_t c);
 int32_t stepgen_pos_get(uint8_t c);
 void stepgen_pos_set(uint8_t c, int32_t pos);
 void stepgen_watchdog_setup(uint8_t enable, uint32_t time);
+uint8_t stepgen_watchdog_expired();
+uint32_t stepgen_loop_ticks_get();
 int8_t volatile stepgen_msg_recv(uint8_t type, uint8_t * msg, uint8_t length);
 
 